@@ -0,0 +1,460 @@
+
+#include "distribute.h"
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#define dup _dup
+#define dup2 _dup2
+#else
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+// NOTE(max): regions start at Region_Size and shrink down to Min_Region_Size until there are at
+// least Regions_Per_Worker per worker, so one slow worker can't hold up the end of the frame.
+static const i32 Region_Size = 128;
+static const i32 Min_Region_Size = 32;
+static const i32 Regions_Per_Worker = 4;
+
+static bool read_fd(i32 fd, void* buf, size_t size) {
+	u8* p = (u8*)buf;
+	while(size) {
+#ifdef _WIN32
+		i32 n = _read(fd, p, (u32)size);
+#else
+		ssize_t n = read(fd, p, size);
+#endif
+		if(n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool write_fd(i32 fd, const void* buf, size_t size) {
+	const u8* p = (const u8*)buf;
+	while(size) {
+#ifdef _WIN32
+		i32 n = _write(fd, p, (u32)size);
+#else
+		ssize_t n = write(fd, p, size);
+#endif
+		if(n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+struct worker_proc {
+
+	static worker_proc make(std::string exe, const std::vector<std::string>& args);
+	void destroy();
+
+	bool send(const void* buf, size_t size);
+	bool recv(void* buf, size_t size);
+
+	bool ok = false;
+
+private:
+#ifdef _WIN32
+	HANDLE process = null, in = null, out = null;
+#else
+	pid_t pid = -1;
+	i32 in = -1, out = -1;
+#endif
+};
+
+static std::string self_path() {
+#ifdef _WIN32
+	char buf[MAX_PATH] = {};
+	GetModuleFileNameA(null, buf, MAX_PATH);
+	return buf;
+#else
+	char buf[PATH_MAX] = {};
+	ssize_t len = readlink("/proc/self/exe", buf, PATH_MAX - 1);
+	return len > 0 ? std::string(buf, len) : std::string();
+#endif
+}
+
+// NOTE(max): threads is already this worker's share; the region stays with the coordinator
+static std::vector<std::string> worker_args(i32 w, i32 h, i32 s, const distribute_settings& settings, i32 threads) {
+
+	std::vector<std::string> ret = {"-worker", "-w", std::to_string(w), "-h", std::to_string(h),
+									"-s", std::to_string(s), "-threads", std::to_string(threads),
+									"-order", tile_order_names[(i32)settings.order],
+									"-scene", scene_kind_names[(i32)settings.scene]};
+	if(settings.first_hit) {
+		ret.insert(ret.end(), {"-firsthit", std::to_string(settings.first_hit)});
+	}
+	if(settings.bake_noise) {
+		ret.push_back("-bakenoise");
+	}
+	if(!settings.env.empty()) {
+		// Enough digits to get the exact same float back
+		char scale[32];
+		snprintf(scale, sizeof(scale), "%.9g", settings.env_scale);
+		ret.insert(ret.end(), {"-env", settings.env, "-envscale", scale});
+	}
+	return ret;
+}
+
+#ifdef _WIN32
+
+worker_proc worker_proc::make(std::string exe, const std::vector<std::string>& args) {
+
+	worker_proc ret;
+
+	SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), null, TRUE};
+	HANDLE child_in = null, child_out = null;
+	if(!CreatePipe(&child_in, &ret.in, &sa, 0)) return ret;
+	if(!CreatePipe(&ret.out, &child_out, &sa, 0)) {
+		CloseHandle(child_in);
+		CloseHandle(ret.in);
+		return ret;
+	}
+
+	// Our ends must not be inherited, otherwise the worker never sees EOF
+	SetHandleInformation(ret.in, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(ret.out, HANDLE_FLAG_INHERIT, 0);
+
+	STARTUPINFOA si = {};
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = child_in;
+	si.hStdOutput = child_out;
+	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	std::string cmd = "\"" + exe + "\"";
+	for(const std::string& arg : args) {
+		cmd += " \"" + arg + "\"";
+	}
+
+	PROCESS_INFORMATION pi = {};
+	ret.ok = CreateProcessA(exe.c_str(), (char*)cmd.c_str(), null, null, TRUE, 0, null, null, &si, &pi);
+
+	CloseHandle(child_in);
+	CloseHandle(child_out);
+
+	if(ret.ok) {
+		CloseHandle(pi.hThread);
+		ret.process = pi.hProcess;
+	} else {
+		// Failed workers are skipped without destroy(), so our ends have to go now
+		CloseHandle(ret.in);
+		CloseHandle(ret.out);
+		ret.in = ret.out = null;
+	}
+	return ret;
+}
+
+void worker_proc::destroy() {
+	if(in) CloseHandle(in);
+	if(out) CloseHandle(out);
+	if(process) {
+		WaitForSingleObject(process, INFINITE);
+		CloseHandle(process);
+	}
+	in = out = process = null;
+	ok = false;
+}
+
+bool worker_proc::send(const void* buf, size_t size) {
+	const u8* p = (const u8*)buf;
+	while(size) {
+		DWORD n = 0;
+		if(!WriteFile(in, p, (DWORD)size, &n, null) || !n) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool worker_proc::recv(void* buf, size_t size) {
+	u8* p = (u8*)buf;
+	while(size) {
+		DWORD n = 0;
+		if(!ReadFile(out, p, (DWORD)size, &n, null) || !n) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+#else
+
+worker_proc worker_proc::make(std::string exe, const std::vector<std::string>& args) {
+
+	worker_proc ret;
+
+	i32 to_child[2], from_child[2];
+	if(pipe(to_child)) return ret;
+	if(pipe(from_child)) {
+		close(to_child[0]);
+		close(to_child[1]);
+		return ret;
+	}
+
+	// Later workers must not inherit these, otherwise this worker never sees EOF
+	for(i32 fd : {to_child[0], to_child[1], from_child[0], from_child[1]}) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	std::vector<const char*> argv = {exe.c_str()};
+	for(const std::string& arg : args) {
+		argv.push_back(arg.c_str());
+	}
+	argv.push_back(null);
+
+	ret.pid = fork();
+	if(ret.pid == 0) {
+		dup2(to_child[0], 0);
+		dup2(from_child[1], 1);
+		close(to_child[0]);
+		close(to_child[1]);
+		close(from_child[0]);
+		close(from_child[1]);
+
+		execv(exe.c_str(), (char**)argv.data());
+		_exit(1);
+	}
+
+	close(to_child[0]);
+	close(from_child[1]);
+
+	if(ret.pid < 0) {
+		close(to_child[1]);
+		close(from_child[0]);
+		return ret;
+	}
+
+	ret.in = to_child[1];
+	ret.out = from_child[0];
+	ret.ok = true;
+	return ret;
+}
+
+void worker_proc::destroy() {
+	if(in >= 0) close(in);
+	if(out >= 0) close(out);
+	if(pid > 0) waitpid(pid, null, 0);
+	in = out = pid = -1;
+	ok = false;
+}
+
+bool worker_proc::send(const void* buf, size_t size) {
+	return write_fd(in, buf, size);
+}
+
+bool worker_proc::recv(void* buf, size_t size) {
+	return read_fd(out, buf, size);
+}
+
+#endif
+
+static std::vector<region_job> plan_regions(i32 x0, i32 y0, i32 w, i32 h, i32 workers) {
+
+	i32 size = Region_Size;
+	while(size > Min_Region_Size &&
+		  ((w + size - 1) / size) * ((h + size - 1) / size) < Regions_Per_Worker * workers) {
+		size /= 2;
+	}
+
+	std::vector<region_job> ret;
+	for(i32 y = 0; y < h; y += size) {
+		for(i32 x = 0; x < w; x += size) {
+			ret.push_back({x0 + x, y0 + y, min1(size, w - x), min1(size, h - y)});
+		}
+	}
+	return ret;
+}
+
+bool render_distributed(renderer& out, i32 workers, i32 w, i32 h, i32 s, const distribute_settings& settings) {
+
+	std::string exe = self_path();
+	if(exe.empty()) {
+		std::cout << "Failed to find own executable!" << std::endl;
+		return false;
+	}
+
+#ifndef _WIN32
+	// A worker dying shouldn't take us down with it; the write just fails instead
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	out.clear();
+
+	// Handed out from the back, so reverse to go top to bottom
+	std::vector<region_job> queue = settings.region ? plan_regions(settings.x, settings.y, settings.w, settings.h, workers)
+													: plan_regions(0, 0, w, h, workers);
+	std::reverse(queue.begin(), queue.end());
+	i32 total = (i32)queue.size();
+
+	std::mutex lock;
+	std::condition_variable cv;
+	i32 in_flight = 0, done = 0, alive = 0;
+
+	auto run = [&](worker_proc proc) {
+
+		std::vector<f32> buf;
+		std::vector<v3> colors;
+
+		for(;;) {
+
+			region_job job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				cv.wait(guard, [&] {return !queue.empty() || !in_flight;});
+				if(queue.empty()) break;
+
+				job = queue.back();
+				queue.pop_back();
+				in_flight++;
+			}
+
+			region_job reply;
+			buf.resize(job.w * job.h * 3);
+			bool ok = proc.send(&job, sizeof(job)) && proc.recv(&reply, sizeof(reply)) &&
+					  reply.x == job.x && reply.y == job.y && reply.w == job.w && reply.h == job.h &&
+					  proc.recv(buf.data(), buf.size() * sizeof(f32));
+
+			if(ok) {
+				colors.resize(job.w * job.h);
+				for(i32 i = 0; i < job.w * job.h; i++) {
+					colors[i] = v3(buf[i * 3], buf[i * 3 + 1], buf[i * 3 + 2]);
+				}
+				out.import_region(job.x, job.y, job.w, job.h, colors.data());
+			}
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				in_flight--;
+				if(ok) done++;
+				else queue.push_back(job);
+			}
+			cv.notify_all();
+
+			if(!ok) {
+				std::cout << std::endl << "Lost a worker, handing its region to the others." << std::endl;
+				break;
+			}
+		}
+
+		region_job quit;
+		proc.send(&quit, sizeof(quit));
+		proc.destroy();
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			alive--;
+		}
+		cv.notify_all();
+	};
+
+	// The first total % workers workers take one extra thread
+	i32 total_threads = settings.threads > 0 ? settings.threads : SDL_GetCPUCount();
+
+	std::vector<std::thread> threads;
+	for(i32 i = 0; i < workers; i++) {
+		i32 share = max1(1, total_threads / workers + (i < total_threads % workers));
+		worker_proc proc = worker_proc::make(exe, worker_args(w, h, s, settings, share));
+		if(!proc.ok) {
+			std::cout << "Failed to start worker " << i << "!" << std::endl;
+			continue;
+		}
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			alive++;
+		}
+		threads.emplace_back(run, proc);
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while(done < total && alive) {
+			cv.wait_for(guard, std::chrono::milliseconds(250));
+			std::cout << "Regions: " << done << "/" << total << "\r";
+			std::cout.flush();
+		}
+		queue.clear();
+	}
+	cv.notify_all();
+	std::cout << std::endl;
+
+	for(std::thread& t : threads) {
+		t.join();
+	}
+
+	out.commit();
+	bool streamed = out.close_stream();
+	return done == total && streamed;
+}
+
+i32 worker_main(i32 w, i32 h, i32 s, const distribute_settings& settings) {
+
+	// NOTE(max): the protocol owns the real stdout; anything else that prints goes to stderr
+	i32 in = 0, out = dup(1);
+	dup2(2, 1);
+#ifdef _WIN32
+	_setmode(in, _O_BINARY);
+	_setmode(out, _O_BINARY);
+#endif
+
+	renderer r;
+	r.init(w, h, s, false, settings.threads);
+	r.set_order(settings.order);
+	r.set_first_hit_cache(settings.first_hit);
+
+	scene sc;
+	sc.init(w, h, settings.bake_noise, settings.scene);
+
+	// Exiting drops the pipes, so the coordinator sees this worker as lost
+	if(!sc.set_environment(settings.env, settings.env_scale)) {
+		sc.destroy();
+		r.destroy();
+		return 1;
+	}
+
+	std::vector<v3> colors;
+	std::vector<f32> buf;
+
+	region_job job;
+	while(read_fd(in, &job, sizeof(job)) && job.w > 0 && job.h > 0) {
+
+		if(job.x < 0 || job.y < 0 || job.x + job.w > w || job.y + job.h > h) break;
+
+		r.set_region(true, job.x, job.y, job.w, job.h);
+		r.begin_render(sc);
+		while(!r.finish()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		colors.resize(job.w * job.h);
+		buf.resize(job.w * job.h * 3);
+		r.export_region(job.x, job.y, job.w, job.h, colors.data());
+		for(i32 i = 0; i < job.w * job.h; i++) {
+			buf[i * 3] = colors[i].x;
+			buf[i * 3 + 1] = colors[i].y;
+			buf[i * 3 + 2] = colors[i].z;
+		}
+
+		if(!write_fd(out, &job, sizeof(job)) || !write_fd(out, buf.data(), buf.size() * sizeof(f32))) {
+			break;
+		}
+	}
+
+	sc.destroy();
+	r.destroy();
+	return 0;
+}
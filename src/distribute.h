@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include "render.h"
+
+// NOTE(max): the coordinator spawns local copies of this executable in worker mode and talks to
+// them over their stdin/stdout. Each worker builds the scene itself, and the coordinator hands
+// out regions one at a time as workers finish, so faster processes just take more of the frame.
+// The pipe protocol is the only thing that would have to change to put workers on other boxes.
+
+struct region_job {
+	i32 x = 0, y = 0, w = 0, h = 0;
+};
+
+// Everything besides the size that changes how a frame renders; workers get these on their
+// command line so they render exactly what a single process would.
+struct distribute_settings {
+	// Only this part of the frame is handed out
+	bool region = false;
+	i32 x = 0, y = 0, w = 0, h = 0;
+
+	scene_kind scene = scene_kind::showcase;
+	tile_order order = tile_order::morton;
+	i32 first_hit = 0;
+	bool bake_noise = false;
+
+	// Loaded by each worker; paths are relative to the coordinator's working directory, which
+	// the workers inherit
+	std::string env;
+	f32 env_scale = 1.0f;
+
+	// Render threads across all workers (0 for every core); the coordinator splits them up so
+	// the workers don't each start a full pool. A worker's own -threads is just its share.
+	i32 threads = 0;
+};
+
+// Renders the frame (or settings' region) on `workers` processes and merges their float results
+// into out, which must already be initialized at w x h. Returns false if any region couldn't be
+// rendered.
+bool render_distributed(renderer& out, i32 workers, i32 w, i32 h, i32 s, const distribute_settings& settings);
+
+// Entry point for -worker; reads region_jobs from stdin until one is empty, and answers each
+// with the job followed by w*h mean linear colors.
+i32 worker_main(i32 w, i32 h, i32 s, const distribute_settings& settings);
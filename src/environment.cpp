@@ -0,0 +1,139 @@
+
+#include "environment.h"
+#include "lib/vec.h"
+
+#include <stb_image.h>
+
+environment environment::make(std::string file, f32 intensity) {
+
+	environment ret;
+
+	// stb hands back linear floats for .hdr, and linearizes LDR formats with a 2.2 gamma
+	i32 w = 0, h = 0;
+	f32* pixels = stbi_loadf(file.c_str(), &w, &h, null, 3);
+	if(!pixels) {
+		std::cout << "Failed to load environment from file " << file << "!" << std::endl;
+		return ret;
+	}
+
+	i32 n = w * h;
+	ret.w = w;
+	ret.h = h;
+	ret.texels = new v3[n];
+	ret.prob = new f32[n];
+	ret.alias = new i32[n];
+	ret.pmf = new f32[n];
+
+	f64 total = 0.0;
+	for(i32 y = 0; y < h; y++) {
+
+		// Rows near the poles cover less solid angle
+		f32 sin_theta = sinf(PI32 * (y + 0.5f) / h);
+
+		for(i32 x = 0; x < w; x++) {
+			i32 i = y * w + x;
+			ret.texels[i] = intensity * v3(pixels[3*i], pixels[3*i + 1], pixels[3*i + 2]);
+
+			v3 c = ret.texels[i];
+			f32 lum = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+			ret.pmf[i] = maxf(lum, 0.0f) * sin_theta;
+			total += ret.pmf[i];
+		}
+	}
+	stbi_image_free(pixels);
+
+	// An all black map would divide by zero, so fall back to sampling by solid angle alone
+	if(total <= 0.0) {
+		total = 0.0;
+		for(i32 y = 0; y < h; y++) {
+			f32 sin_theta = sinf(PI32 * (y + 0.5f) / h);
+			for(i32 x = 0; x < w; x++) {
+				ret.pmf[y * w + x] = sin_theta;
+				total += sin_theta;
+			}
+		}
+	}
+
+	// NOTE(max): Vose's method. Scaled probabilities under 1 get topped up by one over 1, which
+	// becomes their alias; whatever is left over just keeps itself.
+	vec<i32> small, large;
+	for(i32 i = 0; i < n; i++) {
+		ret.pmf[i] = (f32)(ret.pmf[i] / total);
+		ret.prob[i] = ret.pmf[i] * n;
+		ret.alias[i] = i;
+		if(ret.prob[i] < 1.0f) small.push(i);
+		else large.push(i);
+	}
+
+	while(!small.empty() && !large.empty()) {
+		i32 s = small[small.size - 1];
+		i32 l = large[large.size - 1];
+		small.size--;
+
+		ret.alias[s] = l;
+		ret.prob[l] -= 1.0f - ret.prob[s];
+
+		if(ret.prob[l] < 1.0f) {
+			large.size--;
+			small.push(l);
+		}
+	}
+	for(i32 i : small) ret.prob[i] = 1.0f;
+	for(i32 i : large) ret.prob[i] = 1.0f;
+
+	small.destroy();
+	large.destroy();
+	return ret;
+}
+
+void environment::destroy() {
+	delete[] texels;
+	delete[] prob;
+	delete[] alias;
+	delete[] pmf;
+	texels = null;
+	prob = pmf = null;
+	alias = null;
+	w = h = 0;
+}
+
+i32 environment::texel_index(v3 dir) const {
+
+	dir = norm(dir);
+	f32 theta = acosf(clamp(dir.y, -1.0f, 1.0f));
+	f32 phi = atan2f(dir.z, dir.x);
+	if(phi < 0.0f) phi += TAU32;
+
+	i32 x = min1((i32)(phi / TAU32 * w), w - 1);
+	i32 y = min1((i32)(theta / PI32 * h), h - 1);
+	return y * w + x;
+}
+
+v3 environment::eval(v3 dir) const {
+	return texels[texel_index(dir)];
+}
+
+f32 environment::pdf(v3 dir) const {
+
+	f32 cos_theta = norm(dir).y;
+	f32 sin_theta = sqrtf(maxf(1.0f - cos_theta * cos_theta, 0.0f));
+	if(sin_theta <= 0.0f) return 0.0f;
+
+	// Each texel is uniform over (2pi / w) * (pi / h) in phi and theta
+	return pmf[texel_index(dir)] * w * h / (2.0f * PI32 * PI32 * sin_theta);
+}
+
+v3 environment::sample(f32& pdf_out) const {
+
+	i32 n = w * h;
+	f32 pick = randomf() * n;
+	i32 i = min1((i32)pick, n - 1);
+	if(pick - i >= prob[i]) i = alias[i];
+
+	f32 phi = (i % w + randomf()) / w * TAU32;
+	f32 theta = (i / w + randomf()) / h * PI32;
+	f32 sin_theta = sinf(theta);
+
+	pdf_out = sin_theta > 0.0f ? pmf[i] * n / (2.0f * PI32 * PI32 * sin_theta) : 0.0f;
+	return v3(sin_theta * cosf(phi), cosf(theta), sin_theta * sinf(phi));
+}
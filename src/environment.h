@@ -0,0 +1,37 @@
+
+#pragma once
+
+#include <string>
+
+#include "lib/math.h"
+
+// NOTE(max): an equirectangular (lat-long) environment that surrounds the scene at infinity.
+// +y is up, and u goes around from +x towards +z. Radiance is piecewise constant per texel, and
+// texels are picked with an alias table weighted by luminance times the solid angle they cover,
+// so importance sampling is O(1) and the pdf matches eval() exactly.
+struct environment {
+
+	static environment make(std::string file, f32 intensity = 1.0f);
+	void destroy();
+
+	bool valid() const {return texels != null;}
+
+	// Radiance arriving from direction dir (need not be normalized)
+	v3 eval(v3 dir) const;
+	// Solid angle density of sample() picking dir
+	f32 pdf(v3 dir) const;
+	// Picks a normalized direction proportional to the environment's brightness
+	v3 sample(f32& pdf_out) const;
+
+private:
+	i32 texel_index(v3 dir) const;
+
+	v3* texels = null;
+	i32 w = 0, h = 0;
+
+	// Vose alias table over the texels: keep i with prob[i], otherwise take alias[i]
+	f32* prob = null;
+	i32* alias = null;
+	// Probability of picking each texel
+	f32* pmf = null;
+};
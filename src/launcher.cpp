@@ -0,0 +1,137 @@
+// NOTE(max): the renderer binaries are built once per ISA with LANE_WIDTH baked in, and can't
+// safely check the CPU themselves - the static initializers in math.h already execute vector
+// code before main. This launcher is built without any ISA flags, so it runs anywhere, picks
+// the widest variant the host supports, and hands over to it with the same arguments.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  i32;
+
+struct cpu_features {
+	bool sse41 = false, avx2 = false, avx512 = false;
+};
+
+static void cpuid(u32 leaf, u32 sub, u32 regs[4]) {
+#ifdef _WIN32
+	__cpuidex((int*)regs, leaf, sub);
+#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static u64 xgetbv() {
+#ifdef _WIN32
+	return _xgetbv(0);
+#else
+	u32 lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((u64)hi << 32) | lo;
+#endif
+}
+
+static cpu_features detect() {
+
+	cpu_features ret;
+	u32 regs[4] = {};
+
+	cpuid(0, 0, regs);
+	u32 max_leaf = regs[0];
+
+	cpuid(1, 0, regs);
+	ret.sse41 = (regs[2] >> 19) & 1;
+
+	// AVX registers are only usable if the OS saves them (OSXSAVE + XCR0 bits 1,2)
+	bool osxsave = (regs[2] >> 27) & 1;
+	bool avx = (regs[2] >> 28) & 1;
+	if(!osxsave || !avx || max_leaf < 7) return ret;
+
+	u64 xcr0 = xgetbv();
+	if((xcr0 & 0x6) != 0x6) return ret;
+
+	cpuid(7, 0, regs);
+	ret.avx2 = (regs[1] >> 5) & 1;
+
+	// AVX-512 additionally needs the opmask and upper ZMM state enabled (XCR0 bits 5,6,7)
+	bool avx512f = (regs[1] >> 16) & 1;
+	bool avx512dq = (regs[1] >> 17) & 1;
+	ret.avx512 = avx512f && avx512dq && (xcr0 & 0xe6) == 0xe6;
+
+	return ret;
+}
+
+static std::string exe_dir(char* argv0) {
+
+	std::string path;
+#ifdef _WIN32
+	char buf[MAX_PATH] = {};
+	GetModuleFileNameA(nullptr, buf, MAX_PATH);
+	path = buf;
+	size_t sep = path.find_last_of("\\/");
+#else
+	char buf[PATH_MAX] = {};
+	ssize_t len = readlink("/proc/self/exe", buf, PATH_MAX - 1);
+	path = len > 0 ? std::string(buf, len) : std::string(argv0);
+	size_t sep = path.find_last_of('/');
+#endif
+	return sep == std::string::npos ? std::string(".") : path.substr(0, sep);
+}
+
+int main(int argc, char** argv) {
+
+	cpu_features cpu = detect();
+
+	const char* variant = nullptr;
+	if(cpu.avx512) variant = "dawn-avx512";
+	else if(cpu.avx2) variant = "dawn-avx2";
+	else if(cpu.sse41) variant = "dawn-sse4";
+
+	if(!variant) {
+		std::cout << "This CPU doesn't support SSE4.1, which is the minimum for dawn!" << std::endl;
+		return 1;
+	}
+
+#ifdef _WIN32
+	std::string exe = exe_dir(argv[0]) + "\\" + variant + ".exe";
+
+	// NOTE(max): _spawnv just joins the arguments with spaces, so quote anything that has them
+	std::vector<std::string> quoted(argc);
+	std::vector<const char*> args(argc + 1, nullptr);
+	for(i32 i = 0; i < argc; i++) {
+		const char* a = i ? argv[i] : exe.c_str();
+		quoted[i] = strchr(a, ' ') ? "\"" + std::string(a) + "\"" : std::string(a);
+		args[i] = quoted[i].c_str();
+	}
+
+	intptr_t ret = _spawnv(_P_WAIT, exe.c_str(), args.data());
+	if(ret == -1) {
+		std::cout << "Failed to launch " << exe << "!" << std::endl;
+		return 1;
+	}
+	return (int)ret;
+#else
+	// execv takes the null-terminated argv as is
+	(void)argc;
+	std::string exe = exe_dir(argv[0]) + "/" + variant;
+	argv[0] = (char*)exe.c_str();
+	execv(exe.c_str(), argv);
+
+	std::cout << "Failed to launch " << exe << "!" << std::endl;
+	return 1;
+#endif
+}
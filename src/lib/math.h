@@ -10,6 +10,10 @@
 #include <immintrin.h>
 #include <xmmintrin.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #if LANE_WIDTH==8
 #define __lane __m256
 #define __add_ps _mm256_add_ps
@@ -32,6 +36,14 @@
 #define __shuffle_ps _mm256_shuffle_ps
 #define __min_ps _mm256_min_ps
 #define __max_ps _mm256_max_ps
+#define __floor_ps _mm256_floor_ps
+#define __lanei __m256i
+#define __cvttps_epi32 _mm256_cvttps_epi32
+#define __add_epi32 _mm256_add_epi32
+#define __and_si _mm256_and_si256
+#define __xor_si _mm256_xor_si256
+#define __i32gather_epi32(base, idx) _mm256_i32gather_epi32(base, idx, 4)
+#define __i32gather_ps(base, idx) _mm256_i32gather_ps(base, idx, 4)
 #elif LANE_WIDTH==4
 #define __lane __m128
 #define __add_ps _mm_add_ps
@@ -44,7 +56,6 @@
 #define __sqrt_ps _mm_sqrt_ps
 #define __setzero_ps _mm_setzero_ps
 #define __casti_ps _mm_castsi128_ps
-#define __cmp_ps _mm_cmp_ps
 #define __set1_epi32 _mm_set1_epi32
 #define __xor_ps _mm_xor_ps
 #define __hadd_ps _mm_hadd_ps
@@ -54,8 +65,71 @@
 #define __shuffle_ps _mm_shuffle_ps
 #define __min_ps _mm_min_ps
 #define __max_ps _mm_max_ps
+#define __floor_ps _mm_floor_ps
+#define __lanei __m128i
+#define __cvttps_epi32 _mm_cvttps_epi32
+#define __add_epi32 _mm_add_epi32
+#define __and_si _mm_and_si128
+#define __xor_si _mm_xor_si128
+#elif LANE_WIDTH==16
+#define __lane __m512
+#define __add_ps _mm512_add_ps
+#define __sub_ps _mm512_sub_ps
+#define __mul_ps _mm512_mul_ps
+#define __div_ps _mm512_div_ps
+#define __or_ps _mm512_or_ps
+#define __and_ps _mm512_and_ps
+#define __set1_ps _mm512_set1_ps
+#define __sqrt_ps _mm512_sqrt_ps
+#define __setzero_ps _mm512_setzero_ps
+#define __casti_ps _mm512_castsi512_ps
+#define __cmp_ps _mm512_cmp_ps_mask
+#define __set1_epi32 _mm512_set1_epi32
+#define __xor_ps _mm512_xor_ps
+#define __min_ps _mm512_min_ps
+#define __max_ps _mm512_max_ps
+#define __floor_ps(x) _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF)
+#define __lanei __m512i
+#define __cvttps_epi32 _mm512_cvttps_epi32
+#define __add_epi32 _mm512_add_epi32
+#define __and_si _mm512_and_si512
+#define __xor_si _mm512_xor_si512
+#define __i32gather_epi32(base, idx) _mm512_i32gather_epi32(idx, base, 4)
+#define __i32gather_ps(base, idx) _mm512_i32gather_ps(idx, base, 4)
 #else
-#error "LANE_WIDTH not 4 or 8"
+#error "LANE_WIDTH not 4, 8 or 16"
+#endif
+
+#define LANE_MASK ((1 << LANE_WIDTH) - 1)
+
+// NOTE(max): _mm_cmp_ps only exists as a VEX instruction, so anything that has to run on
+// SSE4-only machines (v3 and the 4-wide lanes) goes through the legacy fixed-predicate compares.
+// p is always a constant, so this folds down to a single compare once inlined. cmpneq is the
+// unordered not-equal, so NEQ_OQ also has to mask out NaN lanes to agree with the VEX compare.
+inline __m128 _mm_cmp_ps_sse(__m128 l, __m128 r, const int p) {
+	switch(p) {
+	case _CMP_EQ_OQ: return _mm_cmpeq_ps(l, r);
+	case _CMP_NEQ_OQ: return _mm_and_ps(_mm_cmpneq_ps(l, r), _mm_cmpord_ps(l, r));
+	case _CMP_GT_OS: return _mm_cmpgt_ps(l, r);
+	case _CMP_LT_OS: return _mm_cmplt_ps(l, r);
+	case _CMP_GE_OS: return _mm_cmpge_ps(l, r);
+	case _CMP_LE_OS: return _mm_cmple_ps(l, r);
+	default: assert(false);
+	}
+	return _mm_setzero_ps();
+}
+#if LANE_WIDTH==4
+#define __cmp_ps _mm_cmp_ps_sse
+
+// SSE4 has no gathers, so these just do the four loads
+inline __m128i __i32gather_epi32(const int32_t* base, __m128i idx) {
+	return _mm_set_epi32(base[_mm_extract_epi32(idx, 3)], base[_mm_extract_epi32(idx, 2)],
+						 base[_mm_extract_epi32(idx, 1)], base[_mm_extract_epi32(idx, 0)]);
+}
+inline __m128 __i32gather_ps(const float* base, __m128i idx) {
+	return _mm_set_ps(base[_mm_extract_epi32(idx, 3)], base[_mm_extract_epi32(idx, 2)],
+					  base[_mm_extract_epi32(idx, 1)], base[_mm_extract_epi32(idx, 0)]);
+}
 #endif
 
 #ifdef _MSC_VER
@@ -178,6 +252,23 @@ union f32_lane {
 };
 static_assert(sizeof(f32_lane) == LANE_WIDTH * 4, "sizeof(f32_lane) != LANE_WIDTH * 4");
 
+// NOTE(max): lane compares produce a mask_lane. For SSE/AVX this is just an f32_lane with each
+// lane all ones or all zeros; AVX-512 keeps the mask in a k register instead.
+#if LANE_WIDTH==16
+struct mask_lane {
+	__mmask16 m = 0;
+
+	void operator|=(const mask_lane& x) {m = m | x.m;}
+	void operator&=(const mask_lane& x) {m = m & x.m;}
+	inline mask_lane operator~() const {return {(__mmask16)(~m)};}
+
+	mask_lane() {}
+	mask_lane(__mmask16 _m) {m = _m;}
+};
+#else
+typedef f32_lane mask_lane;
+#endif
+
 union v2_lane {
 	struct {
 		__lane x, y;
@@ -402,11 +493,16 @@ struct rand_state {
 	u32 y = 362436069;
 	u32 z = 521288629;
 };
-extern rand_state __state;
+// NOTE(max): per-thread so workers don't race on it; the renderer reseeds it for every tile
+// pass so the image doesn't depend on which thread picked up which tile.
+extern thread_local rand_state __state;
 
 std::ostream& operator<<(std::ostream& out, const v3 r);
 std::ostream& VEC operator<<(std::ostream& out, const v3_lane& r);
 std::ostream& VEC operator<<(std::ostream& out, const f32_lane& r);
+#if LANE_WIDTH==16
+std::ostream& VEC operator<<(std::ostream& out, const mask_lane& r);
+#endif
 void test_math();
 
 inline v2 operator+(const v2 l, const v2 r) {
@@ -508,22 +604,22 @@ inline v3 VEC vmax(const v3 l, const v3 r) {
 	return {_mm_max_ps(l.v,r.v)};
 }
 inline v3 VEC eq_mask(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_EQ_OQ)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_EQ_OQ)};
 }
 inline v3 VEC neq_mask(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_NEQ_OQ)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_NEQ_OQ)};
 }
 inline v3 VEC operator>(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_GT_OS)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_GT_OS)};
 }
 inline v3 VEC operator<(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_LT_OS)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_LT_OS)};
 }
 inline v3 VEC operator>=(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_GE_OS)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_GE_OS)};
 }
 inline v3 VEC operator<=(const v3 l, const v3 r) {
-	return {_mm_cmp_ps(l.v,r.v,_CMP_LE_OS)};
+	return {_mm_cmp_ps_sse(l.v,r.v,_CMP_LE_OS)};
 }
 inline bool VEC none(const v3 v) {
 	return (_mm_movemask_ps(v.v) & 0b111) == 0b0;
@@ -783,27 +879,32 @@ inline v3_lane VEC operator/(const v3 l, const v3_lane& r) {
 	 __div_ps(z, r.z)};
 }
 
-inline f32_lane VEC operator==(const v3_lane& l, const v3_lane& r) {
-	__lane cmpx = __cmp_ps(l.x,r.x,_CMP_EQ_OQ);
-	__lane cmpy = __cmp_ps(l.y,r.y,_CMP_EQ_OQ);
-	__lane cmpz = __cmp_ps(l.z,r.z,_CMP_EQ_OQ);
-	return __and_ps(__and_ps(cmpx,cmpy),cmpz);
+inline i32 VEC movemask(const mask_lane& v) {
+#if LANE_WIDTH==16
+	return v.m;
+#else
+	return __movemask_ps(v.v);
+#endif
 }
-inline f32_lane VEC operator!=(const v3_lane& l, const v3_lane& r) {
-	__lane cmpx = __cmp_ps(l.x,r.x,_CMP_NEQ_OQ);
-	__lane cmpy = __cmp_ps(l.y,r.y,_CMP_NEQ_OQ);
-	__lane cmpz = __cmp_ps(l.z,r.z,_CMP_NEQ_OQ);
-	return __or_ps(__or_ps(cmpx,cmpy),cmpz);
+inline bool VEC none(const mask_lane& v) {
+	return movemask(v) == 0x0;
 }
-
-inline bool VEC none(const f32_lane& v) {
-	return __movemask_ps(v.v) == 0x0;
+inline bool VEC all(const mask_lane& v) {
+	return movemask(v) == LANE_MASK;
 }
-inline bool VEC all(const f32_lane& v) {
-	return __movemask_ps(v.v) == 0xf;
+inline bool VEC any(const mask_lane& v) {
+	return movemask(v) != 0x0;
 }
-inline bool VEC any(const f32_lane& v) {
-	return __movemask_ps(v.v) != 0x0;
+// Index of the lowest set lane, v must not be empty
+inline i32 VEC first(const mask_lane& v) {
+	assert(any(v));
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, movemask(v));
+	return (i32)idx;
+#else
+	return __builtin_ctz(movemask(v));
+#endif
 }
 
 
@@ -932,10 +1033,23 @@ inline v2_lane VEC operator/(const v2 l, const v2_lane& r) {
 	 __div_ps(y, r.y)};
 }
 
-inline f32_lane select(const f32_lane& l, const f32_lane& r, const f32_lane& m) {
+inline f32_lane select(const f32_lane& l, const f32_lane& r, const mask_lane& m) {
+#if LANE_WIDTH==16
+	return {_mm512_mask_blend_ps(m.m,r.v,l.v)};
+#else
 	return {__blendv_ps(r.v,l.v,m.v)};
+#endif
 }
 
+#if LANE_WIDTH==16
+inline mask_lane VEC operator&(const mask_lane& l, const mask_lane& r) {
+	return {(__mmask16)(l.m & r.m)};
+}
+inline mask_lane VEC operator|(const mask_lane& l, const mask_lane& r) {
+	return {(__mmask16)(l.m | r.m)};
+}
+#endif
+
 inline f32_lane VEC operator&(const f32_lane& l, const f32_lane& r) {
 	return {__and_ps(l.v, r.v)};
 }
@@ -943,6 +1057,19 @@ inline f32_lane VEC operator|(const f32_lane& l, const f32_lane& r) {
 	return {__or_ps(l.v, r.v)};
 }
 
+inline mask_lane VEC operator==(const v3_lane& l, const v3_lane& r) {
+	mask_lane cmpx = __cmp_ps(l.x,r.x,_CMP_EQ_OQ);
+	mask_lane cmpy = __cmp_ps(l.y,r.y,_CMP_EQ_OQ);
+	mask_lane cmpz = __cmp_ps(l.z,r.z,_CMP_EQ_OQ);
+	return cmpx & cmpy & cmpz;
+}
+inline mask_lane VEC operator!=(const v3_lane& l, const v3_lane& r) {
+	mask_lane cmpx = __cmp_ps(l.x,r.x,_CMP_NEQ_OQ);
+	mask_lane cmpy = __cmp_ps(l.y,r.y,_CMP_NEQ_OQ);
+	mask_lane cmpz = __cmp_ps(l.z,r.z,_CMP_NEQ_OQ);
+	return cmpx | cmpy | cmpz;
+}
+
 inline v3_lane VEC operator&(const v3_lane& l, const f32_lane& r) {
 	return {__and_ps(l.x, r.v),
 			__and_ps(l.y, r.v),
@@ -1009,58 +1136,58 @@ inline f32_lane VEC operator/(const f32 _l, const f32_lane& r) {
 	return {__div_ps(l, r.v)};
 }
 
-inline f32_lane VEC operator==(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator==(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_EQ_OQ);
 }
-inline f32_lane VEC operator!=(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator!=(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_NEQ_OQ);
 }
-inline f32_lane VEC operator>(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator>(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_GT_OS);
 }
-inline f32_lane VEC operator<(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator<(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_LT_OS);
 }
-inline f32_lane VEC operator>=(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator>=(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_GE_OS);
 }
-inline f32_lane VEC operator<=(const f32_lane& l, const f32_lane& r) {
+inline mask_lane VEC operator<=(const f32_lane& l, const f32_lane& r) {
 	return __cmp_ps(l.v,r.v,_CMP_LE_OS);
 }
-inline f32_lane VEC operator==(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator==(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_EQ_OQ);
 }
-inline f32_lane VEC operator!=(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator!=(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_NEQ_OQ);
 }
-inline f32_lane VEC operator>(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator>(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_GT_OS);
 }
-inline f32_lane VEC operator<(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator<(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_LT_OS);
 }
-inline f32_lane VEC operator>=(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator>=(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_GE_OS);
 }
-inline f32_lane VEC operator<=(const f32_lane& l, f32 r) {
+inline mask_lane VEC operator<=(const f32_lane& l, f32 r) {
 	return __cmp_ps(l.v,__set1_ps(r),_CMP_LE_OS);
 }
-inline f32_lane VEC operator==(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator==(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_EQ_OQ);
 }
-inline f32_lane VEC operator!=(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator!=(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_NEQ_OQ);
 }
-inline f32_lane VEC operator>(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator>(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_GT_OS);
 }
-inline f32_lane VEC operator<(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator<(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_LT_OS);
 }
-inline f32_lane VEC operator>=(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator>=(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_GE_OS);
 }
-inline f32_lane VEC operator<=(f32 l, const f32_lane& r) {
+inline mask_lane VEC operator<=(f32 l, const f32_lane& r) {
 	return __cmp_ps(__set1_ps(l),r.v,_CMP_LE_OS);
 }
 
@@ -1076,6 +1203,9 @@ inline f32_lane VEC vmax(const f32_lane& l, const f32_lane& r) {
 }
 
 inline f32 VEC hsum(const f32_lane& l) {
+#if LANE_WIDTH==16
+	return _mm512_reduce_add_ps(l.v);
+#else
 	__lane v = l.v;
 
 	v = __hadd_ps(v,v);
@@ -1087,9 +1217,13 @@ inline f32 VEC hsum(const f32_lane& l) {
 #else
 	return f.f[0];
 #endif
+#endif
 }
 
 inline f32 VEC hmin(const f32_lane& l) {
+#if LANE_WIDTH==16
+	return _mm512_reduce_min_ps(l.v);
+#else
 	__lane v = l.v;
 
 #if LANE_WIDTH==8
@@ -1099,9 +1233,13 @@ inline f32 VEC hmin(const f32_lane& l) {
     v = __min_ps(v, __shuffle_ps(v, v, _MM_SHUFFLE(0,0,0,1)));
 
 	return f32_lane{v}.f[0];
+#endif
 }
 
 inline f32 VEC hmax(const f32_lane& l) {
+#if LANE_WIDTH==16
+	return _mm512_reduce_max_ps(l.v);
+#else
 	__lane v = l.v;
 
 #if LANE_WIDTH==8
@@ -1111,6 +1249,7 @@ inline f32 VEC hmax(const f32_lane& l) {
     v = __max_ps(v, __shuffle_ps(v, v, _MM_SHUFFLE(0,0,0,1)));
 
 	return f32_lane{v}.f[0];
+#endif
 }
 
 inline f32 VEC hmin(const v3 l) {
@@ -1128,10 +1267,10 @@ inline f32 VEC hmax(const v3 l) {
 }
 
 inline v3 VEC hmin(const v3_lane& l) {
-	return {hmin(l.x),hmin(l.y),hmin(l.z)};
+	return {hmin(l.v[0]),hmin(l.v[1]),hmin(l.v[2])};
 }
 inline v3 VEC hmax(const v3_lane& l) {
-	return {hmax(l.x),hmax(l.y),hmax(l.z)};
+	return {hmax(l.v[0]),hmax(l.v[1]),hmax(l.v[2])};
 }
 
 inline v3_lane VEC operator*(const v3 l, const f32_lane& r) {
@@ -1181,6 +1320,19 @@ inline u32 randomu() {
 	__state.z = t ^ __state.x ^ __state.y;
 	return __state.z;
 }
+inline void seed_random(u32 seed) {
+	// splitmix32 so nearby seeds give unrelated streams; xorshift can't start from all zeros
+	u32 v[3];
+	for(u32 i = 0; i < 3; i++) {
+		u32 z = (seed += 0x9e3779b9);
+		z = (z ^ (z >> 16)) * 0x85ebca6b;
+		z = (z ^ (z >> 13)) * 0xc2b2ae35;
+		v[i] = (z ^ (z >> 16)) | 1;
+	}
+	__state.x = v[0];
+	__state.y = v[1];
+	__state.z = v[2];
+}
 inline f32 randomf() {
 	return (f32)randomu() / UINT32_MAX;
 }
@@ -1194,6 +1346,10 @@ inline v3 random_leunit() {
 	} while(lensq(v) >= 1.0f);
 	return v;
 }
+// Uniform on the unit sphere, since points in the ball are uniform in direction
+inline v3 random_unit() {
+	return norm(random_leunit());
+}
 inline v3 random_ledisk() {
 	v3 v;
 	do {
@@ -1236,6 +1392,9 @@ struct perlin {
 	v3 vecs[256] = {};
 	i32 x_perm[256] = {}, y_perm[256] = {}, z_perm[256] = {};
 
+	// vecs split into components for the lane gathers
+	f32 grad_x[256] = {}, grad_y[256] = {}, grad_z[256] = {};
+
 	// NOTE(max): needs to be initialized after the rand state
 	void init() {
 		for(i32 i = 0; i < 256; i++) {
@@ -1259,6 +1418,11 @@ struct perlin {
 			z_perm[i] = z_perm[locz];
 			z_perm[locz] = tmp;
 		}
+		for(i32 i = 0; i < 256; i++) {
+			grad_x[i] = vecs[i].x;
+			grad_y[i] = vecs[i].y;
+			grad_z[i] = vecs[i].z;
+		}
 	}
 
 	f32 trilerp(v3 pos) const {
@@ -1280,13 +1444,56 @@ struct perlin {
 		return ::trilerp(vals, uvw);
 	}
 
+	// NOTE(max): octaves go across lanes, so the usual seven are a single pass at LANE_WIDTH 8.
+	// Each corner's hash and gradient come from gathers (four plain loads on SSE4), and the
+	// fade and gradient math for every octave happens at once.
 	f32 turb(v3 pos, i32 depth) const {
 
-		f32 accum = 0.0f, weight = 1.0f;
-		for(i32 i = 0; i < depth; i++) {
-			accum += weight * trilerp(pos);
-			weight *= 0.5f;
-			pos *= 2.0f;
+		f32 accum = 0.0f;
+		__lanei mask = __set1_epi32(0xff), one = __set1_epi32(1);
+
+		for(i32 o = 0; o < depth; o += LANE_WIDTH) {
+
+			f32_lane px, py, pz, weight;
+			for(i32 l = 0; l < LANE_WIDTH; l++) {
+				f32 freq = ldexpf(1.0f, o + l);
+				px.f[l] = pos.x * freq;
+				py.f[l] = pos.y * freq;
+				pz.f[l] = pos.z * freq;
+				weight.f[l] = o + l < depth ? 1.0f / freq : 0.0f;
+			}
+
+			f32_lane fx = {__floor_ps(px.v)}, fy = {__floor_ps(py.v)}, fz = {__floor_ps(pz.v)};
+			f32_lane u = px - fx, v = py - fy, w = pz - fz;
+
+			__lanei i = __cvttps_epi32(fx.v), j = __cvttps_epi32(fy.v), k = __cvttps_epi32(fz.v);
+			__lanei xs[2] = {__i32gather_epi32(x_perm, __and_si(i, mask)),
+							 __i32gather_epi32(x_perm, __and_si(__add_epi32(i, one), mask))};
+			__lanei ys[2] = {__i32gather_epi32(y_perm, __and_si(j, mask)),
+							 __i32gather_epi32(y_perm, __and_si(__add_epi32(j, one), mask))};
+			__lanei zs[2] = {__i32gather_epi32(z_perm, __and_si(k, mask)),
+							 __i32gather_epi32(z_perm, __and_si(__add_epi32(k, one), mask))};
+
+			f32_lane su = u * u * (3.0f - 2.0f * u);
+			f32_lane sv = v * v * (3.0f - 2.0f * v);
+			f32_lane sw = w * w * (3.0f - 2.0f * w);
+
+			f32_lane result;
+			for(i32 c = 0; c < 8; c++) {
+				i32 di = c >> 2, dj = (c >> 1) & 1, dk = c & 1;
+
+				__lanei h = __xor_si(__xor_si(xs[di], ys[dj]), zs[dk]);
+				f32_lane gx = {__i32gather_ps(grad_x, h)};
+				f32_lane gy = {__i32gather_ps(grad_y, h)};
+				f32_lane gz = {__i32gather_ps(grad_z, h)};
+
+				f32_lane wx = di ? su : 1.0f - su;
+				f32_lane wy = dj ? sv : 1.0f - sv;
+				f32_lane wz = dk ? sw : 1.0f - sw;
+				result += wx * wy * wz * (gx * (u - (f32)di) + gy * (v - (f32)dj) + gz * (w - (f32)dk));
+			}
+
+			accum += hsum(weight * result);
 		}
 		return accum;
 	}
@@ -1609,6 +1816,9 @@ struct ray {
 	v3 pos, dir;
 	f32 t = 0.0f;
 
+	// Ray cone for texture filtering: width at pos and growth per unit of distance
+	f32 cone = 0.0f, spread = 0.0f;
+
 	v3 get(f32 d) const {
 		return pos + d * dir;
 	}
@@ -1619,6 +1829,26 @@ struct ray {
 	}
 };
 
+// NOTE(max): what slab tests need from a ray, worked out once per ray (and again per transform)
+// so the traversal loop doesn't divide at all
+struct slab_ray {
+	v3 pos, inv_dir, pos_inv;
+
+	// 1 where the ray runs towards -axis, i.e. where a box's max side is its near side
+	u8 sign[3] = {};
+
+	static slab_ray make(const ray& r) {
+		slab_ray ret;
+		ret.pos = r.pos;
+		ret.inv_dir = 1.0f / r.dir;
+		ret.pos_inv = r.pos * ret.inv_dir;
+		for(i32 i = 0; i < 3; i++) {
+			ret.sign[i] = ret.inv_dir[i] < 0.0f;
+		}
+		return ret;
+	}
+};
+
 struct ray_lane {
 	v3_lane pos, dir;
 
@@ -1630,7 +1860,7 @@ struct ray_lane {
 #ifdef MATH_IMPLEMENTATION
 
 perlin g_perlin;
-rand_state __state;
+thread_local rand_state __state;
 
 m4 m4::zero = {{0.0f, 0.0f, 0.0f, 0.0f},
 			   {0.0f, 0.0f, 0.0f, 0.0f},
@@ -1679,6 +1909,18 @@ std::ostream& VEC operator<<(std::ostream& out, const f32_lane& r) {
 	return out;
 }
 
+#if LANE_WIDTH==16
+std::ostream& VEC operator<<(std::ostream& out, const mask_lane& r) {
+	out << "{";
+	for(i32 i = 0; i < LANE_WIDTH; i++) {
+		out << ((r.m >> i) & 1);
+		if(i != LANE_WIDTH - 1) out << ",";
+	}
+	out << "}";
+	return out;
+}
+#endif
+
 void test_math() {
 	{
 		v3 _0(0.5f,1.0f,2.0f);
@@ -1742,12 +1984,15 @@ void test_math() {
 		_2.f[1] = -1.0f;
 		_2.f[2] = 0.0f;
 		_2.f[3] = 1.0f;
-#if LANE_WIDTH==8		
+#if LANE_WIDTH>=8
 		_2.f[4] = 1.0f;
 		_2.f[5] = 2.0f;
 		_2.f[6] = 3.0f;
 		_2.f[7] = 4.0f;
 #endif
+#if LANE_WIDTH==16
+		for(i32 i = 8; i < 16; i++) _2.f[i] = (f32)(i - 3);
+#endif
 
 		std::cout << _2 << std::endl;
 		std::cout << "hmin: " << hmin(_2) << std::endl;
@@ -0,0 +1,360 @@
+
+#include "png.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <future>
+
+// Roughly 256k of raw scanlines per band
+static const i32 Band_Bytes = 1 << 18;
+
+static const i32 Window = 32768;
+static const i32 Hash_Bits = 15;
+static const i32 Max_Chain = 16;
+static const i32 Min_Match = 3;
+static const i32 Max_Match = 258;
+
+static const u32 Adler_Base = 65521;
+
+static const u16 len_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const u8 len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const u16 dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const u8 dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+struct bit_writer {
+
+	std::vector<u8>* out = null;
+	u32 bits = 0, count = 0;
+
+	void put(u32 v, u32 n) {
+		bits |= v << count;
+		count += n;
+		while(count >= 8) {
+			out->push_back((u8)bits);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes go out MSB first, everything else LSB first
+	void put_code(u32 code, u32 n) {
+		u32 rev = 0;
+		for(u32 i = 0; i < n; i++) {
+			rev = (rev << 1) | ((code >> i) & 1);
+		}
+		put(rev, n);
+	}
+
+	void align() {
+		if(count) put(0, 8 - count);
+	}
+};
+
+static void put_literal(bit_writer& bw, u32 v) {
+	if(v < 144) bw.put_code(0x30 + v, 8);
+	else if(v < 256) bw.put_code(0x190 + v - 144, 9);
+	else if(v < 280) bw.put_code(v - 256, 7);
+	else bw.put_code(0xc0 + v - 280, 8);
+}
+
+static void put_match(bit_writer& bw, i32 len, i32 dist) {
+
+	i32 l = 28;
+	while(len_base[l] > len) l--;
+	put_literal(bw, 257 + l);
+	bw.put(len - len_base[l], len_extra[l]);
+
+	i32 d = 29;
+	while(dist_base[d] > dist) d--;
+	bw.put_code(d, 5);
+	bw.put(dist - dist_base[d], dist_extra[d]);
+}
+
+static u32 hash3(const u8* p) {
+	return (((u32)p[0] << 16 | (u32)p[1] << 8 | p[2]) * 2654435761u) >> (32 - Hash_Bits);
+}
+
+static void deflate_fixed(bit_writer& bw, const u8* data, i32 n) {
+
+	std::vector<i32> head(1 << Hash_Bits, -1);
+	std::vector<i32> prev(n);
+
+	auto insert = [&](i32 i) {
+		if(i + Min_Match > n) return;
+		u32 h = hash3(data + i);
+		prev[i] = head[h];
+		head[h] = i;
+	};
+
+	// Fixed Huffman block, not final - the band is closed by the stored block after it
+	bw.put(0, 1);
+	bw.put(1, 2);
+
+	i32 i = 0;
+	while(i < n) {
+
+		i32 best_len = 0, best_dist = 0;
+
+		if(i + Min_Match <= n) {
+			i32 max_len = n - i < Max_Match ? n - i : Max_Match;
+			i32 j = head[hash3(data + i)];
+
+			for(i32 chain = Max_Chain; j >= 0 && i - j <= Window && chain; chain--, j = prev[j]) {
+				if(best_len && (best_len >= max_len || data[j + best_len] != data[i + best_len])) continue;
+				i32 len = 0;
+				while(len < max_len && data[j + len] == data[i + len]) len++;
+				if(len > best_len) {
+					best_len = len;
+					best_dist = i - j;
+					if(len == max_len) break;
+				}
+			}
+		}
+
+		if(best_len >= Min_Match) {
+			put_match(bw, best_len, best_dist);
+			for(i32 k = 0; k < best_len; k++) insert(i + k);
+			i += best_len;
+		} else {
+			put_literal(bw, data[i]);
+			insert(i);
+			i++;
+		}
+	}
+
+	put_literal(bw, 256);
+}
+
+static void deflate_stored(bit_writer& bw, const u8* data, i32 n) {
+
+	for(i32 i = 0; i < n; i += 65535) {
+		u32 len = n - i < 65535 ? n - i : 65535;
+		bw.put(0, 1);
+		bw.put(0, 2);
+		bw.align();
+		bw.put(len, 16);
+		bw.put(~len & 0xffff, 16);
+		bw.out->insert(bw.out->end(), data + i, data + i + len);
+	}
+}
+
+static u32 adler32(const u8* data, size_t n) {
+
+	u32 a = 1, b = 0;
+	while(n) {
+		// 5552 is the most bytes we can sum before b can overflow
+		size_t run = n < 5552 ? n : 5552;
+		n -= run;
+		while(run--) {
+			a += *data++;
+			b += a;
+		}
+		a %= Adler_Base;
+		b %= Adler_Base;
+	}
+	return (b << 16) | a;
+}
+
+// NOTE(max): same as zlib's adler32_combine: the adler32 of A then B, from those of A and B
+static u32 adler32_combine(u32 a1, u32 a2, u64 len2) {
+
+	u32 rem = (u32)(len2 % Adler_Base);
+	u32 sum1 = a1 & 0xffff;
+	u32 sum2 = (rem * sum1) % Adler_Base;
+	sum1 += (a2 & 0xffff) + Adler_Base - 1;
+	sum2 += (a1 >> 16) + (a2 >> 16) + Adler_Base - rem;
+	if(sum1 >= Adler_Base) sum1 -= Adler_Base;
+	if(sum1 >= Adler_Base) sum1 -= Adler_Base;
+	if(sum2 >= (Adler_Base << 1)) sum2 -= (Adler_Base << 1);
+	if(sum2 >= Adler_Base) sum2 -= Adler_Base;
+	return sum1 | (sum2 << 16);
+}
+
+static const u32* crc_table() {
+
+	static u32 table[256] = {};
+	static bool init = [] {
+		for(u32 i = 0; i < 256; i++) {
+			u32 c = i;
+			for(u32 k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)init;
+	return table;
+}
+
+static u32 crc32(u32 crc, const u8* data, size_t n) {
+	const u32* table = crc_table();
+	crc = ~crc;
+	while(n--) crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static u8 paeth(i32 a, i32 b, i32 c) {
+	i32 p = a + b - c;
+	i32 pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc) return (u8)a;
+	if(pb <= pc) return (u8)b;
+	return (u8)c;
+}
+
+// Filters one scanline with the given PNG filter type into out (without the type byte)
+static void filter_row(u8* out, const u8* row, const u8* up, i32 n, i32 type) {
+	for(i32 i = 0; i < n; i++) {
+		i32 a = i >= 4 ? row[i - 4] : 0;
+		i32 b = up ? up[i] : 0;
+		i32 c = i >= 4 && up ? up[i - 4] : 0;
+		switch(type) {
+		case 0: out[i] = row[i]; break;
+		case 1: out[i] = (u8)(row[i] - a); break;
+		case 2: out[i] = (u8)(row[i] - b); break;
+		case 3: out[i] = (u8)(row[i] - ((a + b) >> 1)); break;
+		case 4: out[i] = (u8)(row[i] - paeth(a, b, c)); break;
+		}
+	}
+}
+
+struct png_band {
+	std::vector<u8> raw, chunk;
+	u32 adler = 1, crc = 0;
+};
+
+static void encode_band(png_band& band, const u8* rgba, i32 w, i32 y0, i32 y1, bool last, png_level level) {
+
+	i32 stride = w * 4;
+	band.raw.resize((size_t)(y1 - y0) * (stride + 1));
+
+	// NOTE(max): same heuristic as stb_image_write - try every filter, keep the one whose output
+	// has the smallest sum of absolute (signed) bytes
+	std::vector<u8> trial(stride);
+	for(i32 y = y0; y < y1; y++) {
+
+		const u8* row = rgba + (size_t)y * stride;
+		const u8* up = y ? row - stride : null;
+		u8* out = band.raw.data() + (size_t)(y - y0) * (stride + 1);
+
+		i32 best = 0;
+		if(level != png_level::store) {
+			u32 best_sum = UINT32_MAX;
+			for(i32 type = 0; type < 5; type++) {
+				filter_row(trial.data(), row, up, stride, type);
+				u32 sum = 0;
+				for(i32 i = 0; i < stride; i++) sum += abs((i8)trial[i]);
+				if(sum < best_sum) {
+					best_sum = sum;
+					best = type;
+				}
+			}
+		}
+
+		out[0] = (u8)best;
+		filter_row(out + 1, row, up, stride, best);
+	}
+
+	band.adler = adler32(band.raw.data(), band.raw.size());
+
+	// The chunk is built with its type in front so the CRC can run over both in one go
+	const u8 type[4] = {'I','D','A','T'};
+	band.chunk.assign(type, type + 4);
+
+	bit_writer bw;
+	bw.out = &band.chunk;
+
+	if(level == png_level::store) {
+		deflate_stored(bw, band.raw.data(), (i32)band.raw.size());
+	} else {
+		deflate_fixed(bw, band.raw.data(), (i32)band.raw.size());
+	}
+
+	// Empty stored block: realigns to a byte so the next band can start fresh, and carries
+	// BFINAL for the last one.
+	bw.put(last ? 1 : 0, 1);
+	bw.put(0, 2);
+	bw.align();
+	bw.put(0, 16);
+	bw.put(0xffff, 16);
+
+	band.crc = crc32(0, band.chunk.data(), band.chunk.size());
+	band.raw.clear();
+	band.raw.shrink_to_fit();
+}
+
+static bool write_u32(FILE* f, u32 v) {
+	u8 b[4] = {(u8)(v >> 24), (u8)(v >> 16), (u8)(v >> 8), (u8)v};
+	return fwrite(b, 1, 4, f) == 4;
+}
+
+// type_and_data starts with the 4 byte chunk type
+static bool write_chunk(FILE* f, const u8* type_and_data, size_t size, u32 crc) {
+	return write_u32(f, (u32)(size - 4)) && fwrite(type_and_data, 1, size, f) == size && write_u32(f, crc);
+}
+
+static bool write_chunk(FILE* f, const char* type, const u8* data, u32 size) {
+	std::vector<u8> buf(type, type + 4);
+	buf.insert(buf.end(), data, data + size);
+	return write_chunk(f, buf.data(), buf.size(), crc32(0, buf.data(), buf.size()));
+}
+
+bool png_write(std::string file, const u8* rgba, i32 w, i32 h, png_level level, thread_pool* pool) {
+
+	if(w <= 0 || h <= 0) return false;
+
+	i32 rows = Band_Bytes / (w * 4 + 1);
+	if(rows < 1) rows = 1;
+	i32 count = (h + rows - 1) / rows;
+
+	std::vector<png_band> bands(count);
+	std::vector<std::future<void>> jobs;
+
+	for(i32 i = 0; i < count; i++) {
+		i32 y0 = i * rows, y1 = y0 + rows < h ? y0 + rows : h;
+		bool last = i == count - 1;
+		png_band* band = &bands[i];
+#ifdef USE_THREADING
+		if(pool) {
+			jobs.push_back(pool->enqueue([=] {encode_band(*band, rgba, w, y0, y1, last, level);}));
+			continue;
+		}
+#endif
+		encode_band(*band, rgba, w, y0, y1, last, level);
+	}
+	for(auto& job : jobs) {
+		job.wait();
+	}
+
+	u32 adler = 1;
+	for(i32 i = 0; i < count; i++) {
+		i32 y0 = i * rows, y1 = y0 + rows < h ? y0 + rows : h;
+		adler = adler32_combine(adler, bands[i].adler, (u64)(y1 - y0) * (w * 4 + 1));
+	}
+
+	FILE* f = fopen(file.c_str(), "wb");
+	if(!f) return false;
+
+	static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	u8 ihdr[13] = {(u8)(w >> 24), (u8)(w >> 16), (u8)(w >> 8), (u8)w,
+				   (u8)(h >> 24), (u8)(h >> 16), (u8)(h >> 8), (u8)h,
+				   8, 6, 0, 0, 0}; // 8 bit RGBA, deflate, adaptive filtering, no interlace
+
+	// zlib header: deflate with a 32k window, check bits so it's a multiple of 31
+	const u8 zlib[2] = {0x78, 0x01};
+	const u8 trailer[4] = {(u8)(adler >> 24), (u8)(adler >> 16), (u8)(adler >> 8), (u8)adler};
+
+	bool ok = fwrite(signature, 1, 8, f) == 8 &&
+			  write_chunk(f, "IHDR", ihdr, 13) &&
+			  write_chunk(f, "IDAT", zlib, 2);
+
+	for(i32 i = 0; ok && i < count; i++) {
+		ok = write_chunk(f, bands[i].chunk.data(), bands[i].chunk.size(), bands[i].crc);
+	}
+
+	ok = ok && write_chunk(f, "IDAT", trailer, 4) &&
+		 write_chunk(f, "IEND", null, 0);
+
+	ok = fclose(f) == 0 && ok;
+	return ok;
+}
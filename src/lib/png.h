@@ -0,0 +1,20 @@
+
+#pragma once
+
+#include <string>
+
+#include "basic.h"
+#include "thread_pool.h"
+
+enum class png_level : u8 {
+	store,	// no compression at all, just framing - about as fast as writing the pixels
+	fast	// per-row filters + fixed Huffman LZ77, roughly what stb_image_write produces
+};
+
+// NOTE(max): the image is cut into row bands that are filtered and deflated independently on
+// the pool (inline if pool is null). Each band ends on a byte boundary with an empty stored
+// block, so the bands just concatenate into one zlib stream; each one becomes its own IDAT chunk,
+// and the per-band adler32s are combined at the end. Matches can't reach across bands, which
+// costs a little compression.
+bool png_write(std::string file, const u8* rgba, i32 w, i32 h, png_level level = png_level::fast,
+			   thread_pool* pool = null);
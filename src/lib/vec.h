@@ -33,6 +33,7 @@ struct vec {
 		int new_capacity = capacity ? 2 * capacity : 8;
 		T* new_data = new T[new_capacity];
 		memcpy(new_data,data,sizeof(T)*capacity);
+		delete[] data;
 		capacity = new_capacity;
 		data = new_data;
 	}
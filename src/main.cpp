@@ -10,9 +10,11 @@
 #include <iomanip>
 #include <chrono>
 #include <thread>
+#include <algorithm>
 
 #include "lib/basic.h"
 #include "render.h"
+#include "distribute.h"
 #include "math.h"
 
 #define get(type,name) (args.get<type>(name) ? *args.get<type>(name) : (std::cout << "Failed to get arg " << name << "!" << std::endl, exit(1), type()))
@@ -44,7 +46,91 @@ i32 cli_main(i32 argc, char** argv) {
 	i32 w = get(int,"w");
 	i32 h = get(int,"h");
 	i32 s = get(int,"s");
-	std::string o = get(std::string,"o");
+
+	tile_order order = tile_order::morton;
+	if(args.get<std::string>("order")) {
+		std::string name = get(std::string,"order");
+		auto it = std::find(std::begin(tile_order_names), std::end(tile_order_names), name);
+		if(it == std::end(tile_order_names)) {
+			std::cout << "Unknown tile order " << name << "!" << std::endl;
+			return 1;
+		}
+		order = (tile_order)(it - std::begin(tile_order_names));
+	}
+
+	// -scene name builds one of scene_kind_names instead of the showcase
+	scene_kind kind = scene_kind::showcase;
+	if(args.get<std::string>("scene")) {
+		std::string name = get(std::string,"scene");
+		auto it = std::find(std::begin(scene_kind_names), std::end(scene_kind_names), name);
+		if(it == std::end(scene_kind_names)) {
+			std::cout << "Unknown scene " << name << "!" << std::endl;
+			return 1;
+		}
+		kind = (scene_kind)(it - std::begin(scene_kind_names));
+	}
+
+	// -firsthit N samples each pixel at N x N fixed positions and traces their primary hits once
+	i32 first_hit = 0;
+	if(args.get<int>("firsthit")) {
+		first_hit = get(int,"firsthit");
+		if(first_hit < 0 || first_hit > renderer::Max_First_Hit_Grid) {
+			std::cout << "-firsthit must be between 0 and " << renderer::Max_First_Hit_Grid << "!" << std::endl;
+			return 1;
+		}
+	}
+
+	// -threads N renders on N threads instead of every core; with -workers it's split between them
+	i32 threads = 0;
+	if(args.get<int>("threads")) {
+		threads = get(int,"threads");
+	}
+
+	bool bake_noise = args.get<bool>("bakenoise", false);
+
+	// -env file lights escaping rays with an equirectangular map, scaled by -envscale
+	std::string env;
+	f32 env_scale = 1.0f;
+	if(args.get<std::string>("env")) {
+		env = get(std::string,"env");
+	}
+	if(args.get<float>("envscale")) {
+		env_scale = get(float,"envscale");
+	}
+
+	// What workers need to render the same image we would; the coordinator adds the region
+	distribute_settings settings;
+	settings.order = order;
+	settings.scene = kind;
+	settings.first_hit = first_hit;
+	settings.threads = threads;
+	settings.bake_noise = bake_noise;
+	settings.env = env;
+	settings.env_scale = env_scale;
+
+	if(args.get<bool>("worker", false)) {
+		return worker_main(w,h,s,settings);
+	}
+
+	// -stream file (or - for stdout) writes tiles as .dwt records the moment they finish, in which
+	// case -o is optional.
+	std::string stream, o;
+	if(args.get<std::string>("stream")) {
+		stream = get(std::string,"stream");
+	}
+	if(stream.empty() || args.get<std::string>("o")) {
+		o = get(std::string,"o");
+	}
+
+	// The tiles own stdout, so everything we'd print goes to stderr
+	if(stream == "-") {
+		std::cout.rdbuf(std::cerr.rdbuf());
+	}
+
+	i32 workers = 0;
+	if(args.get<int>("workers")) {
+		workers = get(int,"workers");
+	}
 
 	bool region = false;
 	i32 x = 0, y = 0, rw = 0, rh = 0;
@@ -56,22 +142,136 @@ i32 cli_main(i32 argc, char** argv) {
 		region = true;
 	}
 
+	f32 budget = 0.0f;
+	if(args.get<float>("t")) {
+		budget = get(float,"t");
+	}
+
+	f32 ev = 0.0f;
+	if(args.get<float>("ev")) {
+		ev = get(float,"ev");
+	}
+
+	png_level png = png_level::fast;
+	if(args.get<std::string>("png")) {
+		std::string name = get(std::string,"png");
+		if(name == "store") png = png_level::store;
+		else if(name != "fast") {
+			std::cout << "Unknown PNG level " << name << "!" << std::endl;
+			return 1;
+		}
+	}
+
+	// -checkpoint file writes the render state every -ci seconds (and at the end), and -resume
+	// picks it back up. Resuming with a higher -s adds samples to a finished image.
+	std::string checkpoint;
+	f32 interval = 60.0f;
+	bool resume = args.get<bool>("resume", false);
+	if(args.get<std::string>("checkpoint")) {
+		checkpoint = get(std::string,"checkpoint");
+	}
+	if(args.get<float>("ci")) {
+		interval = get(float,"ci");
+	}
+	if(resume && checkpoint.empty()) {
+		std::cout << "Resuming requires -checkpoint!" << std::endl;
+		return 1;
+	}
+
+	if(workers > 0) {
+
+		// NOTE(max): workers render one region at a time and only report back finished ones, so
+		// there's no whole-frame state to budget or checkpoint.
+		if(budget > 0.0f || !checkpoint.empty()) {
+			std::cout << "-t, -checkpoint and -resume can't be used with -workers!" << std::endl;
+			return 1;
+		}
+
+		settings.region = region;
+		settings.x = x;
+		settings.y = y;
+		settings.w = rw;
+		settings.h = rh;
+
+		std::cout << "Initializing renderer..." << std::endl;
+
+		renderer result;
+		result.init(w,h,s,false);
+		result.set_exposure(ev);
+
+		if(!stream.empty() && !result.set_stream(stream)) {
+			std::cout << "Failed to open stream " << stream << "!" << std::endl;
+			return 1;
+		}
+
+		std::cout << "Rendering " << w << "x" << h << "x" << s << " on " << workers << " workers to " << (o.empty() ? stream : o) << "..." << std::endl;
+		u64 start = SDL_GetPerformanceCounter();
+		bool ok = render_distributed(result, workers, w, h, s, settings);
+		u64 end = SDL_GetPerformanceCounter();
+
+		if(!ok) {
+			std::cout << "Some regions failed to render!" << std::endl;
+		}
+		std::cout << "Finished in " << (f64)(end - start) / SDL_GetPerformanceFrequency() << "s" << std::endl;
+		if(!o.empty()) {
+			std::cout << "Writing to file..." << std::endl;
+			if(!result.write_to_file(o, png)) {
+				std::cout << "Failed to write " << o << "!" << std::endl;
+				ok = false;
+			}
+		}
+		result.destroy();
+
+		return ok ? 0 : 1;
+	}
+
 	std::cout << "Initializing renderer..." << std::endl;
 
 	renderer result;
-	result.init(w,h,s,false);
+	result.init(w,h,s,false,threads);
 	result.set_region(region, x, y, rw, rh);
+	result.set_order(order);
+	result.set_budget(budget);
+	result.set_exposure(ev);
+	result.set_first_hit_cache(first_hit);
 
 	std::cout << "Building scene..." << std::endl;
 
 	scene sc;
-	sc.init(w,h);
+	sc.init(w,h,bake_noise,kind);
+
+	if(!sc.set_environment(env, env_scale)) {
+		return 1;
+	}
+
+	if(resume) {
+		std::cout << "Loading checkpoint " << checkpoint << "..." << std::endl;
+		if(!result.load_checkpoint(checkpoint, sc)) {
+			std::cout << "Failed to load checkpoint " << checkpoint << "!" << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "Rendering " << w << "x" << h << "x" << s << " to " << (o.empty() ? stream : o) << "..." << std::endl;
+	if(!stream.empty() && !result.set_stream(stream)) {
+		std::cout << "Failed to open stream " << stream << "!" << std::endl;
+		return 1;
+	}
 
-	std::cout << "Rendering " << w << "x" << h << "x" << s << " to " << o << "..." << std::endl;
-	u64 start = result.begin_render(sc);
+	u64 start = result.begin_render(sc, resume);
+	u64 last_checkpoint = start;
 
 	std::cout << std::fixed << std::setw(2) << std::setprecision(2) << std::setfill('0');
 	while(!result.finish()) {
+
+		u64 now = SDL_GetPerformanceCounter();
+		if(!checkpoint.empty() && (f64)(now - last_checkpoint) / SDL_GetPerformanceFrequency() >= interval) {
+			if(!result.save_checkpoint(checkpoint, sc)) {
+				std::cout << "Failed to write checkpoint " << checkpoint << "!" << std::endl;
+			}
+			last_checkpoint = now;
+		}
+
 		std::cout << "Progress: [";
 
 		i32 width = std::min(term_width() - 30, 50);
@@ -94,8 +294,15 @@ i32 cli_main(i32 argc, char** argv) {
 
 	std::cout << std::endl;
 	std::cout << "Finished in " << (f64)(end - start) / SDL_GetPerformanceFrequency() << "s" << std::endl;
-	std::cout << "Writing to file..." << std::endl;
-	result.write_to_file(o);
+	if(!o.empty()) {
+		std::cout << "Writing to file..." << std::endl;
+		if(!result.write_to_file(o, png)) {
+			std::cout << "Failed to write " << o << "!" << std::endl;
+		}
+	}
+	if(!checkpoint.empty() && !result.save_checkpoint(checkpoint, sc)) {
+		std::cout << "Failed to write checkpoint " << checkpoint << "!" << std::endl;
+	}
 	result.destroy();
 
 	return 0;
@@ -158,13 +365,20 @@ void begin_frame() {
 	ImGui::NewFrame();
 }
 
+static const f32 Orbit_Speed = 0.005f;
+static const f32 Zoom_Step = 0.9f;
+static const f32 Move_Speed = 0.5f;
+static const i32 First_Hit_Grid = 2;
+
 void gui_main() {
 
 	plt_setup();
 
 	ImGui::GetStyle().WindowRounding = 0.0f;
 
-	bool do_region = false;
+	bool do_region = false, mipmaps = false, interactive = false, first_hit = false, bake_noise = false;
+	i32 order = (i32)tile_order::morton, kind = (i32)scene_kind::showcase;
+	f32 budget = 0.0f, ev = 0.0f;
 	i32 size[3] = {640,480,8};
 	i32 region[4] = {220,270,150,150};
 
@@ -172,6 +386,10 @@ void gui_main() {
 	std::string file = "output.png";
 	file.resize(100);
 
+	std::string env;
+	env.resize(100);
+	f32 env_scale = 1.0f;
+
 	scene s;
 	renderer result;
 
@@ -212,24 +430,66 @@ void gui_main() {
 		ImGui::Checkbox("##do_region", &do_region);
 		ImGui::SameLine();
 		ImGui::InputInt4("Region", region);
+		ImGui::Combo("Order", &order, tile_order_names, IM_ARRAYSIZE(tile_order_names));
+		ImGui::Combo("Scene", &kind, scene_kind_names, IM_ARRAYSIZE(scene_kind_names));
+		ImGui::InputFloat("Budget (s)", &budget);
+		if(ImGui::SliderFloat("Exposure", &ev, -8.0f, 8.0f)) {
+			result.set_exposure(ev);
+			result.tonemap();
+		}
+		if(ImGui::Checkbox("Mipmaps", &mipmaps)) {
+			result.set_mipmaps(mipmaps);
+		}
+		ImGui::SameLine();
+		if(ImGui::Checkbox("Interactive", &interactive)) {
+			result.set_progressive(interactive);
+			if(interactive) start = result.begin_render(s);
+		}
+		ImGui::SameLine();
+		ImGui::Checkbox("First-hit cache", &first_hit);
+		ImGui::SameLine();
+		ImGui::Checkbox("Bake noise", &bake_noise);
 		ImGui::InputText("##file",(char*)file.c_str(),file.size());
 		ImGui::SameLine();
 		if(ImGui::Button("Save")) {
-			result.write_to_file(file);
+			result.write_to_file(file.c_str());
 		}
+		ImGui::InputText("Environment", (char*)env.c_str(), env.size());
+		ImGui::InputFloat("Environment scale", &env_scale);
 
-		if(ImGui::Button("Generate")) {
-			result.destroy();
-			s.destroy();
+		// NOTE(max): Generate keeps the thread pool and the built scene and only resizes what
+		// depends on the resolution; Rebuild also throws away and rebuilds the scene.
+		bool generate = ImGui::Button("Generate");
+		ImGui::SameLine();
+		bool rebuild = ImGui::Button("Rebuild");
+		if(generate || rebuild) {
+			result.resize(size[0], size[1], size[2]);
+
+			if(rebuild) {
+				s.destroy();
+				s.init(size[0], size[1], bake_noise, (scene_kind)kind);
+				s.set_environment(env.c_str(), env_scale);
+			} else {
+				s.resize(size[0], size[1]);
+			}
 
-			s.init(size[0], size[1]);
-			result.init(size[0], size[1], size[2]);
+			result.set_mipmaps(mipmaps);
 			result.set_region(do_region, region[0], region[1], region[2], region[3]);
+			result.set_order((tile_order)order);
+			result.set_budget(budget);
+			result.set_exposure(ev);
+			result.set_progressive(interactive);
+			result.set_first_hit_cache(first_hit ? First_Hit_Grid : 0);
 
 			start = result.begin_render(s);
 		}
 		ImGui::SameLine();
 		if(result.in_progress()) {
+			if(ImGui::Button("Cancel")) {
+				result.cancel();
+				time = SDL_GetPerformanceCounter() - start;
+			}
+			ImGui::SameLine();
 			ImGui::ProgressBar(result.progress());
 		} else {
 			ImGui::Text("Time: %.3fms", 1000.0f * (f64)time / SDL_GetPerformanceFrequency());
@@ -241,6 +501,50 @@ void gui_main() {
 
 		ImGui::Image((ImTextureID)(iptr)result.handle, {(f32)size[0],(f32)size[1]});
 
+		// NOTE(max): drag to orbit, right/middle drag to pan, wheel to zoom, WASDQE to fly.
+		// Any change cancels the render, moves the camera, and restarts from one sample.
+		if(interactive) {
+
+			f32 yaw = 0.0f, pitch = 0.0f, pan_x = 0.0f, pan_y = 0.0f, zoom = 1.0f;
+			v3 move;
+
+			if(ImGui::IsItemHovered()) {
+				if(ImGui::IsMouseDragging(0)) {
+					yaw = -io.MouseDelta.x * Orbit_Speed;
+					pitch = io.MouseDelta.y * Orbit_Speed;
+				}
+				if(ImGui::IsMouseDragging(1) || ImGui::IsMouseDragging(2)) {
+					pan_x = -io.MouseDelta.x / size[1];
+					pan_y = io.MouseDelta.y / size[1];
+				}
+				if(io.MouseWheel) {
+					zoom = powf(Zoom_Step, io.MouseWheel);
+				}
+			}
+
+			if(!io.WantTextInput) {
+				f32 step = Move_Speed * io.DeltaTime;
+				if(io.KeysDown[SDL_SCANCODE_W]) move.z += step;
+				if(io.KeysDown[SDL_SCANCODE_S]) move.z -= step;
+				if(io.KeysDown[SDL_SCANCODE_D]) move.x += step;
+				if(io.KeysDown[SDL_SCANCODE_A]) move.x -= step;
+				if(io.KeysDown[SDL_SCANCODE_E]) move.y += step;
+				if(io.KeysDown[SDL_SCANCODE_Q]) move.y -= step;
+			}
+
+			if(yaw || pitch || pan_x || pan_y || zoom != 1.0f || lensq(move)) {
+				result.cancel();
+
+				camera& cam = s.cam();
+				if(yaw || pitch) cam.orbit(yaw, pitch);
+				if(pan_x || pan_y) cam.pan(pan_x, pan_y);
+				if(zoom != 1.0f) cam.dolly(zoom);
+				if(lensq(move)) cam.move(move);
+
+				start = result.begin_render(s);
+			}
+		}
+
 		ImGui::End();
 
 		render_frame();
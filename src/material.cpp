@@ -10,7 +10,7 @@ isotropic isotropic::make(texture t) {
 scatter isotropic::bsdf(const ray& incoming, const trace& surface) const {
 	scatter ret;
 	ret.out = {surface.pos, random_leunit(), incoming.t};
-	ret.attenuation = tex.sample(surface.uv, surface.pos);
+	ret.attenuation = tex.sample(surface.uv, surface.pos, surface.footprint);
 	return ret;
 }
 
@@ -22,7 +22,7 @@ diffuse diffuse::make(texture t) {
 
 scatter diffuse::bsdf(const ray&, const trace& surface) const {
 	scatter ret;
-	ret.emitted = tex.sample(surface.uv, {});
+	ret.emitted = tex.sample(surface.uv, {}, surface.footprint);
 	ret.attenuation = {1.0f};
 	ret.absorbed = true;
 	return ret;
@@ -36,9 +36,14 @@ lambertian lambertian::make(texture t) {
 
 scatter lambertian::bsdf(const ray& incoming, const trace& surface) const {
 	scatter ret;
-	v3 out = surface.pos + surface.normal + random_leunit();
-	ret.out = {surface.pos, out - surface.pos, incoming.t};
-	ret.attenuation = tex.sample(surface.uv, surface.pos);
+
+	// NOTE(max): the normal plus a point on the unit sphere (not in the ball) is cosine distributed,
+	// which is what the albedo-only attenuation and the pdf shade() MISes with both assume.
+	// Right at the opposite pole it can cancel out, so fall back to the normal there.
+	v3 dir = surface.normal + random_unit();
+	if(lensq(dir) < 1e-8f) dir = surface.normal;
+	ret.out = {surface.pos, dir, incoming.t};
+	ret.attenuation = tex.sample(surface.uv, surface.pos, surface.footprint);
 	return ret;
 }
 
@@ -132,6 +137,9 @@ void materal_cache::clear() {
 }
 
 void materal_cache::destroy() {
+	for(material& m : mats) {
+		m.destroy();
+	}
 	mats.destroy();
 	next_id = 0;
 }
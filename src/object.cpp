@@ -25,16 +25,7 @@ box box::make(i32 mat, v3 min, v3 max) {
 	box ret;
 	ret.min = min;
 	ret.max = max;
-
-	ret.sides[0] = rect::make(mat, plane::xy, {min.x, max.x}, {min.y, max.y}, max.z);
-	ret.sides[1] = rect::make(mat, plane::xy, {min.x, max.x}, {min.y, max.y}, min.z);
-
-	ret.sides[2] = rect::make(mat, plane::zx, {min.z, max.z}, {min.x, max.x}, max.y);
-	ret.sides[3] = rect::make(mat, plane::zx, {min.z, max.z}, {min.x, max.x}, min.y);
-
-	ret.sides[4] = rect::make(mat, plane::yz, {min.y, max.y}, {min.z, max.z}, max.x);
-	ret.sides[5] = rect::make(mat, plane::yz, {min.y, max.y}, {min.z, max.z}, min.x);
-
+	ret.mat = mat;
 	return ret;
 }
 
@@ -44,17 +35,65 @@ aabb box::bbox(v2) const {
 }
 
 trace box::hit(const ray& r, v2 t) const {
+	return hit(r, slab_ray::make(r), t);
+}
+
+trace box::hit(const ray& r, const slab_ray& s, v2 t) const {
 
 	trace ret;
-	f32 closest = t.y;
-	for(const rect& re : sides) {
-		trace next = re.hit(r, {t.x, closest});
-		if(next.hit) {
-			ret = next;
-			closest = next.t;
+
+	v3 _0 = (min - s.pos) * s.inv_dir;
+	v3 _1 = (max - s.pos) * s.inv_dir;
+	v3 near = vmin(_0,_1), far = vmax(_0,_1);
+
+	// The box is entered through the last slab to be entered and left through the first to be left
+	f32 t_in = maxf(maxf(near.x, near.y), near.z);
+	f32 t_out = minf(minf(far.x, far.y), far.z);
+	if(t_in > t_out) return ret;
+
+	// From inside, the near side is behind the ray and the far one is what gets hit
+	f32 t_hit = t_in >= t.x ? t_in : t_out;
+	if(t_hit < t.x || t_hit > t.y) return ret;
+
+	surface(ret, r, s, t_hit, min, max, mat);
+	return ret;
+}
+
+void box::surface(trace& ret, const ray& r, const slab_ray& s, f32 t, v3 min, v3 max, i32 mat) {
+
+	static const u8 u_axis[3] = {1, 2, 0}, v_axis[3] = {2, 0, 1};
+
+	ret.hit = true;
+	ret.t = t;
+	ret.mat = mat;
+	ret.pos = r.get(t);
+
+	// t came from one of the slabs, so the face is on whichever axis produced it
+	v3 _0 = (min - s.pos) * s.inv_dir;
+	v3 _1 = (max - s.pos) * s.inv_dir;
+
+	i32 w = 0;
+	f32 best = FLT_MAX;
+	for(i32 i = 0; i < 3; i++) {
+		f32 d = minf(fabsf(_0[i] - t), fabsf(_1[i] - t));
+		if(d < best) {
+			best = d;
+			w = i;
 		}
 	}
-	return ret;	
+	i32 u = u_axis[w], v = v_axis[w];
+
+	// NOTE(max): same as the faces used to be as rects: uvs span each face, and the normal faces
+	// back along the ray whichever side it came from
+	ret.uv = {(ret.pos[u] - min[u]) / (max[u] - min[u]), (ret.pos[v] - min[v]) / (max[v] - min[v])};
+	ret.uv_scale = 1.0f / sqrtf((max[u] - min[u]) * (max[v] - min[v]));
+	ret.normal[w] = r.dir[w] < 0.0f ? 1.0f : -1.0f;
+}
+
+bool box::span(const ray& r, v2& t) const {
+
+	t = {-FLT_MAX, FLT_MAX};
+	return aabb{min, max}.clip(r, t);
 }
 
 volume volume::make(i32 phase_mat, f32 density, object* bound) {
@@ -69,32 +108,111 @@ aabb volume::bbox(v2 t) const {
 	return bound->bbox(t);
 }
 
+bool volume::span(const ray& r, v2& t) const {
+
+	// NOTE(max): spheres and boxes give both ends in one test. Anything else is intersected twice,
+	// going in and coming out, which only works for convex bounds.
+	if(!bound->do_trans) {
+		if(bound->type == obj::sphere) return bound->s.span(r, t);
+		if(bound->type == obj::box) return bound->bx.span(r, t);
+	}
+
+	trace b0 = bound->hit(r, {-FLT_MAX, FLT_MAX});
+	if(!b0.hit) return false;
+
+	trace b1 = bound->hit(r, {b0.t + 0.0001f, FLT_MAX});
+	if(!b1.hit) return false;
+
+	t = {b0.t, b1.t};
+	return true;
+}
+
 trace volume::hit(const ray& r, v2 t) const {
 
 	trace ret;
 
-	trace b0 = bound->hit(r, {-FLT_MAX, FLT_MAX});
-	if(b0.hit) {
+	v2 in;
+	if(!span(r, in)) return ret;
 
-		trace b1 = bound->hit(r, {b0.t + 0.0001f, FLT_MAX});
-		if(b1.hit) {
+	in.x = max1(in.x, t.x);
+	in.y = min1(in.y, t.y);
+	if(in.x >= in.y) return ret;
+
+	in.x = max1(in.x, 0.0f);
+
+	f32 dlen = len(r.dir);
+	f32 d = (in.y - in.x) * dlen;
+	f32 h = - (1.0f / density) * logf(randomf());
+
+	if(h < d) {
+
+		ret.hit = true;
+		ret.t = in.x + h / dlen;
+		ret.pos = r.get(ret.t);
+		ret.mat = phase_mat;
+	}
+
+	return ret;
+}
+
+bool volume::inside(v3 pos) const {
+
+	// The bound is convex, so pos is inside if a ray from it starts out between the two ends
+	v2 in;
+	return span({pos, {0.0f, 0.0f, 1.0f}, 0.0f}, in) && in.x <= 0.0f && in.y >= 0.0f;
+}
 
-			b0.t = max1(b0.t, t.x);
-			b1.t = min1(b1.t, t.y);
-			if(b0.t >= b1.t) return ret;
+f32 volume::transmittance(const ray& r, v2 t) const {
 
-			b0.t = max1(b0.t, 0.0f);
-			
-			f32 dlen = len(r.dir);
-			f32 d = (b1.t - b0.t) * dlen;
-			f32 h = - (1.0f / density) * logf(randomf());
+	v2 in;
+	if(!span(r, in)) return 1.0f;
 
-			if(h < d) {
+	in.x = max1(in.x, t.x);
+	in.y = min1(in.y, t.y);
+	if(in.x >= in.y) return 1.0f;
 
-				ret.hit = true;
-				ret.t = b0.t + h / dlen;
-				ret.pos = r.get(ret.t);
-				ret.mat = phase_mat;
+	return expf(-density * (in.y - in.x) * len(r.dir));
+}
+
+volume_grid volume_grid::make(i32 phase_mat, v3 min, v3 max, i32 rx, i32 ry, i32 rz,
+							  const f32* density, f32 sigma) {
+
+	assert(rx > 0 && ry > 0 && rz > 0);
+
+	volume_grid ret;
+	ret.phase_mat = phase_mat;
+	ret.min = min;
+	ret.max = max;
+	ret.res[0] = rx;
+	ret.res[1] = ry;
+	ret.res[2] = rz;
+	ret.scale = v3((f32)rx, (f32)ry, (f32)rz) / (max - min);
+
+	i32 n = rx * ry * rz;
+	ret.grid = new f32[n];
+	for(i32 i = 0; i < n; i++) {
+		ret.grid[i] = maxf(density[i], 0.0f) * sigma;
+	}
+
+	for(i32 i = 0; i < 3; i++) {
+		ret.mres[i] = (ret.res[i] + Majorant_Cell - 1) / Majorant_Cell;
+	}
+	ret.majorant = new f32[ret.mres[0] * ret.mres[1] * ret.mres[2]];
+
+	// Interpolating anywhere in a cell can reach one voxel past it on each side
+	for(i32 cz = 0; cz < ret.mres[2]; cz++) {
+		for(i32 cy = 0; cy < ret.mres[1]; cy++) {
+			for(i32 cx = 0; cx < ret.mres[0]; cx++) {
+
+				f32 m = 0.0f;
+				for(i32 z = max1(cz * Majorant_Cell - 1, 0); z <= min1((cz + 1) * Majorant_Cell, rz - 1); z++) {
+					for(i32 y = max1(cy * Majorant_Cell - 1, 0); y <= min1((cy + 1) * Majorant_Cell, ry - 1); y++) {
+						for(i32 x = max1(cx * Majorant_Cell - 1, 0); x <= min1((cx + 1) * Majorant_Cell, rx - 1); x++) {
+							m = maxf(m, ret.grid[(z * ry + y) * rx + x]);
+						}
+					}
+				}
+				ret.majorant[(cz * ret.mres[1] + cy) * ret.mres[0] + cx] = m;
 			}
 		}
 	}
@@ -102,6 +220,145 @@ trace volume::hit(const ray& r, v2 t) const {
 	return ret;
 }
 
+void volume_grid::destroy() {
+	delete[] grid;
+	delete[] majorant;
+	grid = majorant = null;
+}
+
+aabb volume_grid::bbox(v2) const {
+	return {min, max};
+}
+
+bool volume_grid::inside(v3 pos) const {
+	return pos.x >= min.x && pos.y >= min.y && pos.z >= min.z &&
+		   pos.x <= max.x && pos.y <= max.y && pos.z <= max.z;
+}
+
+f32 volume_grid::density(v3 pos) const {
+
+	v3 g = (pos - min) * scale - 0.5f;
+
+	i32 i0[3], i1[3];
+	v3 f;
+	for(i32 i = 0; i < 3; i++) {
+		f32 fl = floorf(g[i]);
+		f[i] = g[i] - fl;
+		i0[i] = min1(max1((i32)fl, 0), res[i] - 1);
+		i1[i] = min1(max1((i32)fl + 1, 0), res[i] - 1);
+	}
+
+	f32 vals[2][2][2];
+	for(i32 z = 0; z < 2; z++) {
+		for(i32 y = 0; y < 2; y++) {
+			for(i32 x = 0; x < 2; x++) {
+				i32 ix = x ? i1[0] : i0[0];
+				i32 iy = y ? i1[1] : i0[1];
+				i32 iz = z ? i1[2] : i0[2];
+				vals[x][y][z] = grid[(iz * res[1] + iy) * res[0] + ix];
+			}
+		}
+	}
+	return trilerp(vals, f);
+}
+
+// NOTE(max): 3D DDA through the majorant grid. Inside each cell, tentative collisions are spaced
+// by exponential steps against that cell's majorant; since the steps are memoryless, a flight that
+// runs past the cell edge can just restart from there. collide gets each tentative collision's t
+// and density / majorant, and returns true to stop.
+template<typename F>
+void volume_grid::track(const ray& r, v2 t, F&& collide) const {
+
+	if(!aabb{min, max}.clip(r, t)) return;
+
+	v3 cell_scale = scale / (f32)Majorant_Cell;
+	v3 o = (r.pos - min) * cell_scale;
+	v3 d = r.dir * cell_scale;
+	v3 p = o + d * t.x;
+	f32 dlen = len(r.dir);
+
+	i32 cell[3], step[3];
+	f32 next[3], delta[3];
+	for(i32 i = 0; i < 3; i++) {
+		cell[i] = min1(max1((i32)floorf(p[i]), 0), mres[i] - 1);
+		if(d[i] > 0.0f) {
+			step[i] = 1;
+			next[i] = t.x + (cell[i] + 1 - p[i]) / d[i];
+			delta[i] = 1.0f / d[i];
+		} else if(d[i] < 0.0f) {
+			step[i] = -1;
+			next[i] = t.x + (cell[i] - p[i]) / d[i];
+			delta[i] = -1.0f / d[i];
+		} else {
+			step[i] = 0;
+			next[i] = delta[i] = FLT_MAX;
+		}
+	}
+
+	f32 at = t.x;
+	while(at < t.y) {
+
+		i32 axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		f32 end = min1(next[axis], t.y);
+
+		f32 maj = majorant[(cell[2] * mres[1] + cell[1]) * mres[0] + cell[0]];
+		if(maj > 0.0f) {
+
+			f32 inv = 1.0f / (maj * dlen);
+			for(;;) {
+				at -= logf(1.0f - randomf()) * inv;
+				if(at >= end) break;
+				if(collide(at, density(r.get(at)) / maj)) return;
+			}
+		}
+
+		at = end;
+		cell[axis] += step[axis];
+		if(cell[axis] < 0 || cell[axis] >= mres[axis]) return;
+		next[axis] += delta[axis];
+	}
+}
+
+trace volume_grid::hit(const ray& r, v2 t) const {
+
+	trace ret;
+
+	// Delta tracking: a tentative collision is real with probability density / majorant
+	track(r, t, [&](f32 at, f32 ratio) -> bool {
+		if(randomf() >= ratio) return false;
+		ret.hit = true;
+		ret.t = at;
+		return true;
+	});
+
+	if(ret.hit) {
+		ret.pos = r.get(ret.t);
+		ret.mat = phase_mat;
+	}
+	return ret;
+}
+
+f32 volume_grid::transmittance(const ray& r, v2 t) const {
+
+	f32 ret = 1.0f;
+
+	// Ratio tracking: every tentative collision lets through 1 - density / majorant, and once
+	// little is left russian roulette ends the walk without biasing it
+	track(r, t, [&](f32, f32 ratio) -> bool {
+		ret *= maxf(1.0f - ratio, 0.0f);
+		if(ret < 0.1f) {
+			if(randomf() < 0.5f) {
+				ret = 0.0f;
+				return true;
+			}
+			ret *= 2.0f;
+		}
+		return false;
+	});
+
+	return ret;
+}
+
 rect rect::make(i32 mat, plane type, v2 u, v2 v, f32 w) {
 	rect ret;
 	ret.type = type;
@@ -137,32 +394,90 @@ trace rect::hit(const ray& r, v2 t) const {
 
 	trace ret;
 
-	u8 w_idx = (u8)type;
-	u8 u_idx = ((u8)type + 1) % 3;
-	u8 v_idx = ((u8)type + 2) % 3;
+	u8 w_idx = W_Axis[(u8)type];
+	u8 u_idx = U_Axis[(u8)type];
+	u8 v_idx = V_Axis[(u8)type];
 
 	f32 t_pos = (w - r.pos[w_idx]) / r.dir[w_idx];
 
 	if(t_pos < t.x || t_pos > t.y) return ret;
 
-	v3 at = r.get(t_pos);
+	f32 at_u = r.pos[u_idx] + t_pos * r.dir[u_idx];
+	f32 at_v = r.pos[v_idx] + t_pos * r.dir[v_idx];
+
+	if(at_u < u.x || at_u > u.y || at_v < v.x || at_v > v.y) return ret;
+
+	surface(ret, r, t_pos, type, u, v, mat);
+	return ret;
+}
+
+void rect::surface(trace& ret, const ray& r, f32 t, plane type, v2 u, v2 v, i32 mat) {
 
-	if(at[u_idx] < u.x || at[u_idx] > u.y || at[v_idx] < v.x || at[v_idx] > v.y) return ret;
+	u8 w_idx = W_Axis[(u8)type];
+	u8 u_idx = U_Axis[(u8)type];
+	u8 v_idx = V_Axis[(u8)type];
+
+	v3 at = r.get(t);
 
 	ret.hit = true;
-	ret.t = t_pos;
+	ret.t = t;
 	ret.mat = mat;
 	ret.uv = {(at[u_idx] - u.x) / (u.y - u.x), (at[v_idx] - v.x) / (v.y - v.x)};
+	ret.uv_scale = 1.0f / sqrtf((u.y - u.x) * (v.y - v.x));
 	ret.pos = at;
 
 	// NOTE(max): double sided plane
-	ret.normal[w_idx] = 1.0f;
-	ret.normal[w_idx] = dot(ret.normal, r.dir) < 0.0f ? 1.0f : -1.0f;
+	ret.normal[w_idx] = r.dir[w_idx] < 0.0f ? 1.0f : -1.0f;
+}
+
+rect_lane rect_lane::make(plane type, v2_lane u, v2_lane v, f32_lane w, f32_lane m) {
+	rect_lane ret;
+	ret.type = type;
+	ret.u = u;
+	ret.v = v;
+	ret.w = w;
+	ret.mat = m;
+	return ret;
+}
 
+aabb rect_lane::bbox(v2 t) const {
+
+	aabb ret = rect::make(0, type, u[0], v[0], w.f[0]).bbox(t);
+	for(i32 i = 1; i < LANE_WIDTH; i++) {
+		ret = aabb::enclose(ret, rect::make(0, type, u[i], v[i], w.f[i]).bbox(t));
+	}
 	return ret;
 }
 
-i16 bvh::node::populate(const vec<object>& list, vec<object>& objs, vec<node>& nodes, 
+trace rect_lane::hit(const ray& r, v2 t) const {
+
+	trace ret;
+
+	u8 w_idx = rect::W_Axis[(u8)type];
+	u8 u_idx = rect::U_Axis[(u8)type];
+	u8 v_idx = rect::V_Axis[(u8)type];
+
+	f32_lane _t = (w - r.pos[w_idx]) / r.dir[w_idx];
+	f32_lane at_u = r.pos[u_idx] + _t * r.dir[u_idx];
+	f32_lane at_v = r.pos[v_idx] + _t * r.dir[v_idx];
+
+	mask_lane hit_mask = (_t >= t.x) & (_t <= t.y) &
+						 (at_u >= u.v[0]) & (at_u <= u.v[1]) &
+						 (at_v >= v.v[0]) & (at_v <= v.v[1]);
+
+	if(none(hit_mask)) return ret;
+
+	f32_lane t_max{t.y};
+	_t = select(_t, t_max, hit_mask);
+
+	f32 t_hit = hmin(_t);
+	i32 idx = first(_t == t_hit);
+	rect::surface(ret, r, t_hit, type, u[idx], v[idx], mat.i[idx]);
+
+	return ret;
+}
+
+i16 bvh::node::populate(const vec<object>& list, prim_store& prims, vec<node>& nodes, 
 						v2 t, i32 leaf_span, std::function<object(vec<object>)> create_leaf) {
 
 	i32 axis = randomu() % 3;
@@ -183,9 +498,10 @@ i16 bvh::node::populate(const vec<object>& list, vec<object>& objs, vec<node>& n
 
 		ret.type_ = type::leaf;
 
-		objs.push(create_leaf(list));
-		ret.left = (i16)(objs.size - 1);
-		ret.box_ = objs[ret.left].bbox(t);
+		prim_ref ref = prims.add(create_leaf(list));
+		ret.leaf = ref.type;
+		ret.left = ref.idx;
+		ret.box_ = prims.bbox(ref, t);
 
 		nodes.push(ret);
 		idx = (i16)(nodes.size - 1);
@@ -193,18 +509,17 @@ i16 bvh::node::populate(const vec<object>& list, vec<object>& objs, vec<node>& n
 	} else {
 		
 		ret.type_ = type::node;
+		ret.axis = (u8)axis;
 
 		vec<object>::split split = list.halves();
 
-		ret.left = populate(split.l, objs, nodes, t, leaf_span, create_leaf);
-		ret.right = populate(split.r, objs, nodes, t, leaf_span, create_leaf);
+		ret.left = populate(split.l, prims, nodes, t, leaf_span, create_leaf);
+		ret.right = populate(split.r, prims, nodes, t, leaf_span, create_leaf);
 		ret.box_ = aabb::enclose(nodes[ret.left].box_, nodes[ret.right].box_);
 
 		// TODO(max): can we make this a complete tree with implicit parent/children position?
 		nodes.push(ret);
 		idx = (i16)(nodes.size - 1);
-		nodes[ret.left].parent = idx;
-		nodes[ret.right].parent = idx;
 	}
 
 	return idx;
@@ -215,10 +530,11 @@ bvh bvh::make(const vec<object>& objs, v2 t) {
 	assert(!objs.empty());
 
 	bvh ret;
-	ret.root = node::populate(objs, ret.objects, ret.nodes, t, 1, 
+	ret.root = node::populate(objs, ret.prims, ret.nodes, t, 1, 
 		[](vec<object> list) -> object {
 			return list[0];
 		});
+	ret.pick_kernel();
 
 	return ret;
 }
@@ -229,13 +545,31 @@ bvh bvh::make(const vec<object>& objs, v2 t, i32 leaf_span,
 	assert(!objs.empty());
 
 	bvh ret;
-	ret.root = node::populate(objs, ret.objects, ret.nodes, t, leaf_span, create_leaf);
+	ret.root = node::populate(objs, ret.prims, ret.nodes, t, leaf_span, create_leaf);
+	ret.pick_kernel();
 
 	return ret;	
 }
 
+void bvh::pick_kernel() {
+
+	mixed = false;
+	leaves = prim::object;
+
+	bool first = true;
+	for(const node& n : nodes) {
+		if(n.type_ != node::type::leaf) continue;
+		if(first) {
+			leaves = n.leaf;
+			first = false;
+		} else if(n.leaf != leaves) {
+			mixed = true;
+		}
+	}
+}
+
 void bvh::destroy() {
-	objects.destroy();
+	prims.destroy();
 	nodes.destroy();
 	root = -1;
 }
@@ -245,102 +579,147 @@ aabb bvh::bbox(v2) const {
 	return nodes[root].box_;
 }
 
-// NOTE(max): http://citeseerx.ist.psu.edu/viewdoc/download?doi=10.1.1.445.7529&rep=rep1&type=pdf
-trace bvh::hit(const ray& r, v2 t) const {
+f32 bvh::transmittance(const ray& r, v2 t) const {
 
 	assert(root >= 0 && root < nodes.size);
 
-	trace result;
-	
-	// Current node index
-	i16 idx = nodes[root].left;
-
-	// Where we are visiting this node from
-	state s = state::parent;
-
-	for(;;) {
-		switch(s) {
-
-		// Visit left nodes from their parent
-		case state::parent: {
-			
-			node current = nodes[idx];
-
-			if(current.box_.hit(r, t)) {
-				if(current.type_ == node::type::leaf) {
-					
-					result = trace::min(result, objects[current.left].hit(r, t));
-				
-					// Finished, traverse right subtree
-					idx = nodes[current.parent].right;
-					s = state::sibling;
-
-				} else {
-
-					// Traverse left subtree
-					idx = current.left;
-					s = state::parent;
-				}
-			} else {
+	// Without any media in the tree, light either makes it or it doesn't
+	if(prims.objects.empty()) return occluded(r, t) ? 0.0f : 1.0f;
 
-				// Finished, traverse right subtree
-				idx = nodes[current.parent].right;
-				s = state::sibling;
-			}
-		} break;
+	// NOTE(max): every leaf along the ray has to be visited, not just the nearest one
+	slab_ray s = slab_ray::make(r);
+	i16 stack[Max_Stack];
+	i32 top = 0;
+	stack[top++] = root;
 
-		// Visit right nodes from their left node sibling
-		case state::sibling: {
+	f32 ret = 1.0f;
+	while(top) {
 
-			node current = nodes[idx];
+		const node& current = nodes[stack[--top]];
+		if(!current.box_.hit(s, t)) continue;
 
-			if(current.box_.hit(r, t)) {
-				if(current.type_ == node::type::leaf) {
+		if(current.type_ == node::type::leaf) {
 
-					result = trace::min(result, objects[current.left].hit(r, t));
+			ret *= prims.transmittance({current.leaf, current.left}, r, s, t);
+			if(ret <= 0.0f) return 0.0f;
 
-					// Finished, go up
-					idx = current.parent;
-					s = state::child;
+		} else {
 
-				} else {
+			assert(top + 2 <= Max_Stack);
+			stack[top++] = current.right;
+			stack[top++] = current.left;
+		}
+	}
+	return ret;
+}
 
-					// Traverse left subtree
-					idx = current.left;
-					s = state::parent;
-				}
-			} else {
+// NOTE(max): most trees only hold one kind of leaf (everything from a lane builder, say), so
+// kernel gets a leaf test with that leaf's hit inlined, picked once per ray instead of switching
+// on every leaf. Mixed trees go through prim_store's switch.
+template<typename K>
+auto bvh::with_leaves(const ray& r, const slab_ray& s, K&& kernel) const {
+
+	if(!mixed) {
+		switch(leaves) {
+		case prim::sphere: return kernel([&](const node& n, v2 t) {return prims.spheres[n.left].hit(r, t);});
+		case prim::sphere_moving: return kernel([&](const node& n, v2 t) {return prims.spheres_moving[n.left].hit(r, t);});
+		case prim::sphere_lane: return kernel([&](const node& n, v2 t) {return prims.sphere_lanes[n.left].hit(r, t);});
+		case prim::sphere_moving_lane: return kernel([&](const node& n, v2 t) {return prims.sphere_moving_lanes[n.left].hit(r, t);});
+		case prim::rect: return kernel([&](const node& n, v2 t) {return prims.rects[n.left].hit(r, t);});
+		case prim::rect_lane: return kernel([&](const node& n, v2 t) {return prims.rect_lanes[n.left].hit(r, t);});
+		case prim::box: return kernel([&](const node& n, v2 t) {return prims.boxes[n.left].hit(r, s, t);});
+		case prim::box_lane: return kernel([&](const node& n, v2 t) {return prims.box_lanes[n.left].hit(r, s, t);});
+		default: break;
+		}
+	}
+	return kernel([&](const node& n, v2 t) {return prims.hit({n.leaf, n.left}, r, s, t);});
+}
 
-				// Fished, go up
-				idx = current.parent;
-				s = state::child;
-			}
-		} break;
+// NOTE(max): children are visited nearest first, going by which way the ray points along the
+// axis they were split on, and every hit pulls in the far end of t. Whatever lies entirely
+// behind the closest hit so far then fails its box test and gets skipped.
+template<typename F>
+trace bvh::closest(const slab_ray& s, v2 t, F&& leaf_hit) const {
 
-		// Visit all nodes from their children when traversing back up the tree
-		case state::child: {
-			
-			// Traversal complete
-			if(idx == root) return result;
-			
-			i16 p_idx = nodes[idx].parent;
-			node parent = nodes[p_idx];
+	i16 stack[Max_Stack];
+	i32 top = 0;
+	stack[top++] = root;
 
-			// Traverse right subtree
-			if(idx == parent.left) {
+	trace result;
+	while(top) {
 
-				idx = parent.right;
-				s = state::sibling;
+		const node& current = nodes[stack[--top]];
+		if(!current.box_.hit(s, t)) continue;
 
-			// Finished, go up
-			} else {
+		if(current.type_ == node::type::leaf) {
 
-				idx = p_idx;
-				s = state::child;
+			trace next = leaf_hit(current, t);
+			if(next.hit) {
+				result = next;
+				t.y = next.t;
 			}
-		} break;
+
+		} else {
+
+			// Far child goes on the stack first so the near one comes off next
+			bool flip = s.sign[current.axis];
+
+			assert(top + 2 <= Max_Stack);
+			stack[top++] = flip ? current.left : current.right;
+			stack[top++] = flip ? current.right : current.left;
+		}
+	}
+	return result;
+}
+
+template<typename F>
+bool bvh::any(const slab_ray& s, v2 t, F&& leaf_hit) const {
+
+	i16 stack[Max_Stack];
+	i32 top = 0;
+	stack[top++] = root;
+
+	while(top) {
+
+		const node& current = nodes[stack[--top]];
+		if(!current.box_.hit(s, t)) continue;
+
+		if(current.type_ == node::type::leaf) {
+
+			if(leaf_hit(current, t).hit) return true;
+
+		} else {
+
+			// Near first still helps, since close things are the likeliest to be in the way
+			bool flip = s.sign[current.axis];
+
+			assert(top + 2 <= Max_Stack);
+			stack[top++] = flip ? current.left : current.right;
+			stack[top++] = flip ? current.right : current.left;
 		}
 	}
+	return false;
+}
+
+trace bvh::hit(const ray& r, v2 t) const {
+
+	assert(root >= 0 && root < nodes.size);
+
+	// NOTE(max): the slab_ray is made once here and shared by every node and box leaf on the way
+	slab_ray s = slab_ray::make(r);
+	return with_leaves(r, s, [&](auto&& leaf_hit) {return closest(s, t, leaf_hit);});
+}
+
+bool bvh::inside_medium(v3 pos) const {
+	return prims.inside_medium(pos);
+}
+
+bool bvh::occluded(const ray& r, v2 t) const {
+
+	assert(root >= 0 && root < nodes.size);
+
+	slab_ray s = slab_ray::make(r);
+	return with_leaves(r, s, [&](auto&& leaf_hit) {return any(s, t, leaf_hit);});
 }
 
 void aabb::transform(m4 trans) {
@@ -370,11 +749,34 @@ aabb aabb::enclose(const aabb& l, const aabb& r) {
 }
 
 bool aabb::hit(const ray& r, v2 t) const {
+	return hit(slab_ray::make(r), t);
+}
 
-	v3 inv_dir = 1.0f / r.dir;
+bool aabb::hit(const slab_ray& s, v2 t) const {
 
-	v3 _0 = (min - r.pos) * inv_dir;
-	v3 _1 = (max - r.pos) * inv_dir;
+	// NOTE(max): the sign bits pick each axis' near and far side straight away instead of sorting
+	// them with min/max, and bound * inv - pos * inv is a single multiply-add. An axis the ray runs
+	// exactly parallel to can come out NaN, which only ever lets the box through - fine for culling,
+	// but anything that reports a hit goes through clip.
+	const v3* bounds = &min;
+
+	for(i32 i = 0; i < 3; i++) {
+		f32 t0 = bounds[s.sign[i]][i] * s.inv_dir[i] - s.pos_inv[i];
+		f32 t1 = bounds[1 - s.sign[i]][i] * s.inv_dir[i] - s.pos_inv[i];
+		t.x = t0 > t.x ? t0 : t.x;
+		t.y = t1 < t.y ? t1 : t.y;
+	}
+	return t.x < t.y;
+}
+
+bool aabb::clip(const ray& r, v2& t) const {
+	return clip(slab_ray::make(r), t);
+}
+
+bool aabb::clip(const slab_ray& s, v2& t) const {
+
+	v3 _0 = (min - s.pos) * s.inv_dir;
+	v3 _1 = (max - s.pos) * s.inv_dir;
 
 	v3 t0 = vmax(vmin(_0,_1),t.x);
 	v3 t1 = vmin(vmax(_0,_1),t.y);
@@ -394,6 +796,12 @@ v2 sphere::map(v3 pos) {
 	return {1.0f - (phi + PI32) / TAU32, (theta + PI32 / 2.0f) / PI32};
 }
 
+f32 sphere::uv_scale(f32 rad) {
+
+	// u wraps once around the equator and v goes pole to pole, so average the two
+	return 1.0f / (PI32 * sqrtf(2.0f) * rad);
+}
+
 v2 sphere::uv(const trace& info) const {
 	return map((pos - info.pos) / rad);
 }
@@ -431,6 +839,7 @@ trace sphere::hit(const ray& r, v2 t) const {
 		ret.pos = r.get(result);
 		ret.normal = (ret.pos - pos) / rad;
 		ret.uv = map(-ret.normal);
+		ret.uv_scale = uv_scale(rad);
 		return ret;
 	} 
 	
@@ -442,10 +851,26 @@ trace sphere::hit(const ray& r, v2 t) const {
 		ret.pos = r.get(result);
 		ret.normal = (ret.pos - pos) / rad;
 		ret.uv = map(-ret.normal);
+		ret.uv_scale = uv_scale(rad);
 	}
 	return ret;
 }
 
+bool sphere::span(const ray& r, v2& t) const {
+
+	v3 rel_pos = r.pos - pos;
+	f32 a = lensq(r.dir);
+	f32 b = 2.0f * dot(rel_pos, r.dir);
+	f32 c = lensq(rel_pos) - rad*rad;
+	f32 d = b*b - 4*a*c;
+
+	if(d <= 0.0f) return false;
+
+	f32 sqd = sqrtf(d);
+	t = {(-b - sqd) / (2.0f * a), (-b + sqd) / (2.0f * a)};
+	return true;
+}
+
 sphere_moving sphere_moving::make(v3 p0, v3 p1, f32 r, i32 m, v2 t) {
 	sphere_moving ret;
 	ret.pos0 = p0;
@@ -495,6 +920,10 @@ aabb sphere_lane::bbox(v2) const {
 }
 
 trace sphere_lane::hit(const ray& r, v2 t) const {
+	return hit(r, t, pos, rad, mat);
+}
+
+trace sphere_lane::hit(const ray& r, v2 t, const v3_lane& pos, const f32_lane& rad, const f32_lane& mat) {
 	
 	trace ret;
 	
@@ -504,17 +933,17 @@ trace sphere_lane::hit(const ray& r, v2 t) const {
 	f32_lane c = lensq(rel_pos) - rad*rad;
 	f32_lane d = b*b - 4.0f*a*c;
 
-	f32_lane pos_mask = d > 0.0f;
+	mask_lane pos_mask = d > 0.0f;
 	if(none(pos_mask)) return ret;
 
 	f32_lane sqd = sqrt(d);
 
 	f32_lane pos_t = (-b - sqd) / (2.0f * a);
 	f32_lane neg_t = (-b + sqd) / (2.0f * a);
-	f32_lane pos_t_mask = (pos_t <= t.y) & (pos_t >= t.x);
-	f32_lane neg_t_mask = (neg_t <= t.y) & (neg_t >= t.x);
+	mask_lane pos_t_mask = (pos_t <= t.y) & (pos_t >= t.x);
+	mask_lane neg_t_mask = (neg_t <= t.y) & (neg_t >= t.x);
 	
-	f32_lane hit_mask = pos_t_mask | neg_t_mask;
+	mask_lane hit_mask = pos_t_mask | neg_t_mask;
 
 	if(none(hit_mask)) return ret;
 
@@ -525,38 +954,109 @@ trace sphere_lane::hit(const ray& r, v2 t) const {
 	ret.t = hmin(_t);
 	ret.pos = r.get(ret.t);
 
-	// TODO(max): any way to not do that?
-	i32 idx = 0;
-	for(i32 i = 0; i < LANE_WIDTH; i++) {
-		if(_t.f[i] == ret.t) {
-			idx = i;
-			break;
-		}
-	}
+	i32 idx = first(_t == ret.t);
 	ret.normal = (ret.pos - pos[idx]) / rad.f[idx];
 	ret.uv = sphere::map(-ret.normal);
+	ret.uv_scale = sphere::uv_scale(rad.f[idx]);
 	ret.mat = mat.i[idx];
 
 	return ret;
 }
 
+box_lane box_lane::make(v3_lane min, v3_lane max, f32_lane m) {
+	box_lane ret;
+	ret.min = min;
+	ret.max = max;
+	ret.mat = m;
+	return ret;
+}
+
+aabb box_lane::bbox(v2) const {
+	return {hmin(min), hmax(max)};
+}
+
+trace box_lane::hit(const ray& r, v2 t) const {
+	return hit(r, slab_ray::make(r), t);
+}
+
+trace box_lane::hit(const ray& r, const slab_ray& s, v2 t) const {
+
+	trace ret;
+
+	v3_lane _0 = (min - s.pos) * s.inv_dir;
+	v3_lane _1 = (max - s.pos) * s.inv_dir;
+
+	f32_lane t_in = vmax(vmax(vmin(_0.v[0], _1.v[0]), vmin(_0.v[1], _1.v[1])), vmin(_0.v[2], _1.v[2]));
+	f32_lane t_out = vmin(vmin(vmax(_0.v[0], _1.v[0]), vmax(_0.v[1], _1.v[1])), vmax(_0.v[2], _1.v[2]));
+
+	// Same as box::hit, lane by lane
+	f32_lane _t = select(t_in, t_out, t_in >= t.x);
+	mask_lane hit_mask = (t_in <= t_out) & (_t >= t.x) & (_t <= t.y);
+
+	if(none(hit_mask)) return ret;
+
+	f32_lane t_max{t.y};
+	_t = select(_t, t_max, hit_mask);
+
+	f32 t_hit = hmin(_t);
+	i32 idx = first(_t == t_hit);
+	box::surface(ret, r, s, t_hit, min[idx], max[idx], mat.i[idx]);
+
+	return ret;
+}
+
+sphere_moving_lane sphere_moving_lane::make(v3_lane p0, v3_lane p1, v2_lane t, f32_lane r, f32_lane m) {
+	sphere_moving_lane ret;
+	ret.pos0 = p0;
+	ret.vel = p1 - p0;
+	ret.rad = r;
+	ret.mat = m;
+	for(i32 i = 0; i < LANE_WIDTH; i++) {
+		f32 duration = t.yf[i] - t.xf[i];
+		ret.start.f[i] = t.xf[i];
+		ret.inv_time.f[i] = duration > 0.0f ? 1.0f / duration : 0.0f;
+	}
+	return ret;
+}
+
+v3_lane sphere_moving_lane::center(f32 t) const {
+
+	f32_lane dist = vmin(vmax((t - start) * inv_time, f32_lane{0.0f}), f32_lane{1.0f});
+	return pos0 + vel * dist;
+}
+
+aabb sphere_moving_lane::bbox(v2 t) const {
+
+	v3_lane c0 = center(t.x), c1 = center(t.y);
+	return aabb::enclose({hmin(c0 - rad), hmax(c0 + rad)},
+						 {hmin(c1 - rad), hmax(c1 + rad)});
+}
+
+trace sphere_moving_lane::hit(const ray& r, v2 t) const {
+	return sphere_lane::hit(r, t, center(r.t), rad, mat);
+}
+
 object_list object_list::make(vec<object>& objs) {
 	object_list ret;
-	ret.objects = vec<object>::take(objs);
+	for(const object& o : objs) {
+		ret.refs.push(ret.prims.add(o));
+	}
+	objs.destroy();
 	return ret;
 }
 
 void object_list::destroy() {
-	objects.destroy();
+	prims.destroy();
+	refs.destroy();
 }
 
 aabb object_list::bbox(v2 t) const {
 	
-	assert(!objects.empty());
+	assert(!refs.empty());
 
-	aabb ret = objects[0].bbox(t);
-	for(const object& o : objects) {
-		ret = aabb::enclose(ret,o.bbox(t));
+	aabb ret = prims.bbox(refs[0], t);
+	for(prim_ref ref : refs) {
+		ret = aabb::enclose(ret,prims.bbox(ref, t));
 	}
 	return ret;
 }
@@ -565,8 +1065,9 @@ trace object_list::hit(const ray& r, v2 t) const {
 	
 	trace ret;
 	f32 closest = t.y;		
-	for(const object& o : objects) {
-		trace next = o.hit(r,{t.x,closest});
+	slab_ray s = slab_ray::make(r);
+	for(prim_ref ref : refs) {
+		trace next = prims.hit(ref, r, s, {t.x,closest});
 		if(next.hit) {
 			ret = next;
 			closest = next.t;
@@ -575,6 +1076,117 @@ trace object_list::hit(const ray& r, v2 t) const {
 	return ret;
 }
 
+bool object_list::occluded(const ray& r, v2 t) const {
+
+	slab_ray s = slab_ray::make(r);
+	for(prim_ref ref : refs) {
+		if(prims.occluded(ref, r, s, t)) return true;
+	}
+	return false;
+}
+
+bool object_list::inside_medium(v3 pos) const {
+	return prims.inside_medium(pos);
+}
+
+f32 object_list::transmittance(const ray& r, v2 t) const {
+
+	f32 ret = 1.0f;
+	slab_ray s = slab_ray::make(r);
+	for(prim_ref ref : refs) {
+		ret *= prims.transmittance(ref, r, s, t);
+		if(ret <= 0.0f) return 0.0f;
+	}
+	return ret;
+}
+
+prim_ref prim_store::add(const object& o) {
+
+	prim_ref ret;
+	i32 idx = 0;
+
+	// Transformed primitives need the whole object to carry their matrices
+	switch(o.do_trans ? obj::none : o.type) {
+	case obj::sphere: spheres.push(o.s); idx = spheres.size; ret.type = prim::sphere; break;
+	case obj::sphere_moving: spheres_moving.push(o.sm); idx = spheres_moving.size; ret.type = prim::sphere_moving; break;
+	case obj::sphere_lane: sphere_lanes.push(o.sl); idx = sphere_lanes.size; ret.type = prim::sphere_lane; break;
+	case obj::sphere_moving_lane: sphere_moving_lanes.push(o.sml); idx = sphere_moving_lanes.size; ret.type = prim::sphere_moving_lane; break;
+	case obj::rect: rects.push(o.re); idx = rects.size; ret.type = prim::rect; break;
+	case obj::rect_lane: rect_lanes.push(o.rl); idx = rect_lanes.size; ret.type = prim::rect_lane; break;
+	case obj::box: boxes.push(o.bx); idx = boxes.size; ret.type = prim::box; break;
+	case obj::box_lane: box_lanes.push(o.bl); idx = box_lanes.size; ret.type = prim::box_lane; break;
+	default: objects.push(o); idx = objects.size; ret.type = prim::object; break;
+	}
+
+	assert(idx <= INT16_MAX);
+	ret.idx = (i16)(idx - 1);
+	return ret;
+}
+
+void prim_store::destroy() {
+	spheres.destroy();
+	spheres_moving.destroy();
+	sphere_lanes.destroy();
+	sphere_moving_lanes.destroy();
+	rects.destroy();
+	rect_lanes.destroy();
+	boxes.destroy();
+	box_lanes.destroy();
+	objects.destroy();
+}
+
+aabb prim_store::bbox(prim_ref ref, v2 t) const {
+
+	switch(ref.type) {
+	case prim::sphere: return spheres[ref.idx].bbox(t);
+	case prim::sphere_moving: return spheres_moving[ref.idx].bbox(t);
+	case prim::sphere_lane: return sphere_lanes[ref.idx].bbox(t);
+	case prim::sphere_moving_lane: return sphere_moving_lanes[ref.idx].bbox(t);
+	case prim::rect: return rects[ref.idx].bbox(t);
+	case prim::rect_lane: return rect_lanes[ref.idx].bbox(t);
+	case prim::box: return boxes[ref.idx].bbox(t);
+	case prim::box_lane: return box_lanes[ref.idx].bbox(t);
+	default: return objects[ref.idx].bbox(t);
+	}
+}
+
+trace prim_store::hit(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const {
+
+	switch(ref.type) {
+	case prim::sphere: return spheres[ref.idx].hit(r, t);
+	case prim::sphere_moving: return spheres_moving[ref.idx].hit(r, t);
+	case prim::sphere_lane: return sphere_lanes[ref.idx].hit(r, t);
+	case prim::sphere_moving_lane: return sphere_moving_lanes[ref.idx].hit(r, t);
+	case prim::rect: return rects[ref.idx].hit(r, t);
+	case prim::rect_lane: return rect_lanes[ref.idx].hit(r, t);
+	case prim::box: return boxes[ref.idx].hit(r, s, t);
+	case prim::box_lane: return box_lanes[ref.idx].hit(r, s, t);
+	default: return objects[ref.idx].hit(r, t);
+	}
+}
+
+bool prim_store::occluded(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const {
+
+	if(ref.type == prim::object) return objects[ref.idx].occluded(r, t);
+	return hit(ref, r, s, t).hit;
+}
+
+f32 prim_store::transmittance(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const {
+
+	// Only whole objects can hold media; everything else is a surface
+	if(ref.type == prim::object) return objects[ref.idx].transmittance(r, t);
+	return hit(ref, r, s, t).hit ? 0.0f : 1.0f;
+}
+
+bool prim_store::inside_medium(v3 pos) const {
+
+	// Only whole objects can hold media
+	for(const object& o : objects) {
+		if(o.inside_medium(pos)) return true;
+	}
+	return false;
+}
+
 void sphere_lane_builder::clear() {
 	idx = 0;
 	rad = mat = {0.0f};
@@ -626,3 +1238,161 @@ object sphere_lane_builder::finish() {
 	return lane;
 }
 
+void sphere_moving_lane_builder::clear() {
+	idx = 0;
+	rad = mat = {0.0f};
+	pos0 = pos1 = v3{0.0f};
+	time = v2_lane{0.0f};
+}
+
+void sphere_moving_lane_builder::push(i32 m, v3 p0, v3 p1, v2 t, f32 r) {
+	assert(idx < LANE_WIDTH);
+	pos0.set(idx, p0);
+	pos1.set(idx, p1);
+	time.set(idx, t);
+	rad.f[idx] = r;
+	mat.i[idx] = m;
+	idx++;
+}
+
+void sphere_moving_lane_builder::push(object o) {
+	assert(!o.do_trans);
+	if(o.type == obj::sphere) {
+		push(o.s.mat, o.s.pos, o.s.pos, {}, o.s.rad);
+	} else {
+		assert(o.type == obj::sphere_moving);
+		push(o.sm.mat, o.sm.pos0, o.sm.pos1, {o.sm.time.x, o.sm.time.x + o.sm.time.y}, o.sm.rad);
+	}
+}
+
+bool sphere_moving_lane_builder::done() {
+	return idx == LANE_WIDTH;
+}
+
+bool sphere_moving_lane_builder::not_empty() {
+	return idx > 0;
+}
+
+void sphere_moving_lane_builder::fill() {
+	assert(not_empty());
+	while(idx < LANE_WIDTH) {
+		pos0.set(idx, pos0[idx - 1]);
+		pos1.set(idx, pos1[idx - 1]);
+		time.set(idx, time[idx - 1]);
+		rad.f[idx] = rad.f[idx - 1];
+		mat.i[idx] = mat.i[idx - 1];
+		idx++;
+	}
+}
+
+object sphere_moving_lane_builder::finish() {
+
+	fill();
+	assert(done());
+
+	object lane = object::sphere_moving_lane(mat,pos0,pos1,time,rad);
+	clear();
+	return lane;
+}
+
+void box_lane_builder::clear() {
+	idx = 0;
+	mat = {0.0f};
+	min = max = v3{0.0f};
+}
+
+void box_lane_builder::push(i32 m, v3 mi, v3 ma) {
+	assert(idx < LANE_WIDTH);
+	min.set(idx, mi);
+	max.set(idx, ma);
+	mat.i[idx] = m;
+	idx++;
+}
+
+void box_lane_builder::push(object o) {
+	assert(idx < LANE_WIDTH);
+	assert(o.type == obj::box && !o.do_trans);
+	min.set(idx, o.bx.min);
+	max.set(idx, o.bx.max);
+	mat.i[idx] = o.bx.mat;
+	idx++;
+}
+
+bool box_lane_builder::done() {
+	return idx == LANE_WIDTH;
+}
+
+bool box_lane_builder::not_empty() {
+	return idx > 0;
+}
+
+void box_lane_builder::fill() {
+	assert(not_empty());
+	while(idx < LANE_WIDTH) {
+		min.set(idx, min[idx - 1]);
+		max.set(idx, max[idx - 1]);
+		mat.i[idx] = mat.i[idx - 1];
+		idx++;
+	}
+}
+
+object box_lane_builder::finish() {
+
+	fill();
+	assert(done());
+
+	object lane = object::box_lane(mat,min,max);
+	clear();
+	return lane;
+}
+
+void rect_lane_builder::clear() {
+	for(i32 i = 0; i < 3; i++) {
+		u[i] = v[i] = v2_lane{0.0f};
+		w[i] = mat[i] = {0.0f};
+		idx[i] = 0;
+	}
+}
+
+void rect_lane_builder::push(i32 m, plane type, v2 _u, v2 _v, f32 _w) {
+	i32 p = (i32)type;
+	assert(idx[p] < LANE_WIDTH);
+	u[p].set(idx[p], _u);
+	v[p].set(idx[p], _v);
+	w[p].f[idx[p]] = _w;
+	mat[p].i[idx[p]] = m;
+	idx[p]++;
+}
+
+void rect_lane_builder::push(object o) {
+	assert(o.type == obj::rect && !o.do_trans);
+	push(o.re.mat, o.re.type, o.re.u, o.re.v, o.re.w);
+}
+
+object rect_lane_builder::finish() {
+
+	vec<object> lanes;
+
+	for(i32 p = 0; p < 3; p++) {
+		if(!idx[p]) continue;
+
+		// Unused lanes repeat the last rect
+		for(i32 i = idx[p]; i < LANE_WIDTH; i++) {
+			u[p].set(i, u[p][i - 1]);
+			v[p].set(i, v[p][i - 1]);
+			w[p].f[i] = w[p].f[i - 1];
+			mat[p].i[i] = mat[p].i[i - 1];
+		}
+		lanes.push(object::rect_lane((plane)p, mat[p], u[p], v[p], w[p]));
+	}
+	assert(!lanes.empty());
+
+	clear();
+
+	if(lanes.size == 1) {
+		object ret = lanes[0];
+		lanes.destroy();
+		return ret;
+	}
+	return object::list(lanes);
+}
@@ -16,9 +16,13 @@ enum class obj : u8 {
 	sphere,
 	sphere_moving,
 	sphere_lane,
+	sphere_moving_lane,
 	rect,
+	rect_lane,
 	box,
-	volume
+	box_lane,
+	volume,
+	volume_grid
 };
 
 enum class plane : u8 {
@@ -35,6 +39,9 @@ struct trace {
 	v2 uv;
 	v3 pos, normal;
 
+	// uv units per world unit around the hit, and the ray cone width there in uv units
+	f32 uv_scale = 0.0f, footprint = 0.0f;
+
 	static trace min(const trace& l, const trace& r);
 	void transform(m4 trans, m4 norm);
 };
@@ -45,6 +52,10 @@ struct aabb {
 
 	static aabb enclose(const aabb& l, const aabb& r);
 	bool hit(const ray& incoming, v2 t) const;
+	bool hit(const slab_ray& incoming, v2 t) const;
+	// Like hit, but also narrows t down to where the ray is inside the box
+	bool clip(const ray& incoming, v2& t) const;
+	bool clip(const slab_ray& incoming, v2& t) const;
 	void transform(m4 trans);
 };
 
@@ -55,13 +66,49 @@ struct volume {
 
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
+	f32 transmittance(const ray& r, v2 t) const;
+	bool inside(v3 pos) const;
 
 private:
+	bool span(const ray& r, v2& t) const;
+
 	object* bound = null;
 	f32 density = 0.0f;
 	i32 phase_mat = 0;
 };
 
+// NOTE(max): heterogeneous medium filling an axis aligned box. Densities sit at voxel centers
+// and are trilinearly interpolated. A coarse grid holds the largest density each block of
+// Majorant_Cell^3 voxels can interpolate to, and rays walk it cell by cell: free flights are
+// delta tracked against the local majorant, and transmittance is ratio tracked the same way,
+// so thin or empty regions cost next to nothing.
+struct volume_grid {
+
+	// density is rx * ry * rz values with x fastest; it's copied and scaled by sigma
+	static volume_grid make(i32 phase_mat, v3 min, v3 max, i32 rx, i32 ry, i32 rz,
+							const f32* density, f32 sigma);
+	void destroy();
+
+	aabb bbox(v2 t) const;
+	trace hit(const ray& r, v2 t) const;
+	f32 transmittance(const ray& r, v2 t) const;
+	bool inside(v3 pos) const;
+
+	static constexpr i32 Majorant_Cell = 8;
+
+private:
+	template<typename F> void track(const ray& r, v2 t, F&& collide) const;
+	f32 density(v3 pos) const;
+
+	v3 min, max;
+	// World to voxel units
+	v3 scale;
+	i32 res[3] = {}, mres[3] = {};
+	f32* grid = null;
+	f32* majorant = null;
+	i32 phase_mat = 0;
+};
+
 struct rect {
 
 	static rect make(i32 mat, plane type, v2 u, v2 v, f32 w);
@@ -70,64 +117,58 @@ struct rect {
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
 
+	// Fills in the surface of a rect where r hits its plane at t; rect_lane only calls this for
+	// the winning lane
+	static void surface(trace& ret, const ray& r, f32 t, plane type, v2 u, v2 v, i32 mat);
+
+	// Which of x, y, z each plane's w, u and v are
+	static constexpr u8 W_Axis[3] = {0, 1, 2};
+	static constexpr u8 U_Axis[3] = {1, 2, 0};
+	static constexpr u8 V_Axis[3] = {2, 0, 1};
+
 private:
 	v2 u, v;
 	f32 w = 0.0f;
 	i32 mat = 0;
 	plane type = plane::xy;
+
+	friend struct rect_lane_builder;
 };
 
-struct box {
+// NOTE(max): LANE_WIDTH rects that all lie in the same kind of plane
+struct rect_lane {
 
-	static box make(i32 mat, v3 min, v3 max);
+	static rect_lane make(plane type, v2_lane u, v2_lane v, f32_lane w, f32_lane m);
 	void destroy() {}
 
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
 
 private:
-	v3 min, max;
-	rect sides[6];
+	v2_lane u, v;
+	f32_lane w, mat;
+	plane type = plane::xy;
 };
 
-struct bvh {
+struct box {
 
-	static bvh make(const vec<object>& objs, v2 t);
-	static bvh make(const vec<object>& objs, v2 t, i32 leaf_span,
-					std::function<object(vec<object>)> create_leaf);
-	void destroy();
+	static box make(i32 mat, v3 min, v3 max);
+	void destroy() {}
 
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
+	trace hit(const ray& r, const slab_ray& s, v2 t) const;
+	bool span(const ray& r, v2& t) const;
 
-private:
-
-	enum class state : u8 {
-		parent,
-		sibling,
-		child
-	};
+	// Fills in the surface of the box [min, max] where r hits it at t; shared with box_lane so
+	// lanes only pay for this once they've picked a winner
+	static void surface(trace& ret, const ray& r, const slab_ray& s, f32 t, v3 min, v3 max, i32 mat);
 
-	struct node {
-		enum class type : u8 {
-			node,
-			leaf
-		};
-
-		static i16 populate(const vec<object>& list, vec<object>& objs, vec<node>& nodes, 
-							v2 t, i32 leaf_span, std::function<object(vec<object>)> create_leaf);
-
-		aabb box_;
-		type type_ = type::node;
-
-		// NOTE(max): note-> both populated with bvh::nodes, leaf-> left populated with object, right ignored 
-		// (leaves just wrap single objects)
-		i16 left = 0, right = 0, parent = 0;
-	};
+private:
+	v3 min, max;
+	i32 mat = 0;
 
-	i16 root = -1;
-	vec<object> objects;
-	vec<node> nodes;
+	friend struct box_lane_builder;
 };
 
 struct sphere {
@@ -136,9 +177,12 @@ struct sphere {
 	void destroy() {}
 
 	static v2 map(v3 pos);
+	static f32 uv_scale(f32 rad);
 
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
+	// Both roots, whether or not they're in front of the ray
+	bool span(const ray& r, v2& t) const;
 
 private:
 	
@@ -149,6 +193,7 @@ private:
 	i32 mat = 0;
 
 	friend struct sphere_lane_builder;
+	friend struct sphere_moving_lane_builder;
 };
 
 struct sphere_moving {
@@ -168,6 +213,8 @@ private:
 	f32 rad = 0.0f;
 	i32 mat = 0;
 	v2 time;
+
+	friend struct sphere_moving_lane_builder;
 };
 
 struct sphere_lane {
@@ -178,6 +225,9 @@ struct sphere_lane {
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
 
+	// Nearest hit against LANE_WIDTH spheres centered at pos
+	static trace hit(const ray& r, v2 t, const v3_lane& pos, const f32_lane& rad, const f32_lane& mat);
+
 private:
 
 	v3_lane pos;
@@ -185,6 +235,141 @@ private:
 	f32_lane mat;
 };
 
+// NOTE(max): LANE_WIDTH spheres moving linearly, each over its own time range. All the centers
+// for the ray's time are found in one go, then it's the same test as sphere_lane.
+struct sphere_moving_lane {
+
+	static sphere_moving_lane make(v3_lane p0, v3_lane p1, v2_lane t, f32_lane r, f32_lane m);
+	void destroy() {}
+
+	aabb bbox(v2 t) const;
+	trace hit(const ray& r, v2 t) const;
+
+private:
+
+	v3_lane center(f32 t) const;
+
+	v3_lane pos0, vel;
+	// Start time and 1 / duration; spheres that don't move have 0 for the latter
+	f32_lane start, inv_time;
+	f32_lane rad;
+	f32_lane mat;
+};
+
+struct box_lane {
+
+	static box_lane make(v3_lane min, v3_lane max, f32_lane m);
+	void destroy() {}
+
+	aabb bbox(v2 t) const;
+	trace hit(const ray& r, v2 t) const;
+	trace hit(const ray& r, const slab_ray& s, v2 t) const;
+
+private:
+
+	v3_lane min, max;
+	f32_lane mat;
+};
+
+enum class prim : u8 {
+	object = 0,
+	sphere,
+	sphere_moving,
+	sphere_lane,
+	sphere_moving_lane,
+	rect,
+	rect_lane,
+	box,
+	box_lane
+};
+
+struct prim_ref {
+	prim type = prim::object;
+	i16 idx = 0;
+};
+
+// NOTE(max): primitives kept in one array per type, so each takes only as much room as it needs
+// rather than as much as the largest object does. Anything with a transform, and composites like
+// trees, lists and volumes, stay whole objects.
+struct prim_store {
+
+	prim_ref add(const object& o);
+	void destroy();
+
+	aabb bbox(prim_ref ref, v2 t) const;
+	// s is r's slab_ray, made once by the caller for however many prims it tests; only boxes use it
+	trace hit(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const;
+	f32 transmittance(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const;
+	bool occluded(prim_ref ref, const ray& r, const slab_ray& s, v2 t) const;
+	bool inside_medium(v3 pos) const;
+
+	vec<sphere> spheres;
+	vec<sphere_moving> spheres_moving;
+	vec<sphere_lane> sphere_lanes;
+	vec<sphere_moving_lane> sphere_moving_lanes;
+	vec<rect> rects;
+	vec<rect_lane> rect_lanes;
+	vec<box> boxes;
+	vec<box_lane> box_lanes;
+	vec<object> objects;
+};
+
+struct bvh {
+
+	static bvh make(const vec<object>& objs, v2 t);
+	static bvh make(const vec<object>& objs, v2 t, i32 leaf_span,
+					std::function<object(vec<object>)> create_leaf);
+	void destroy();
+
+	aabb bbox(v2 t) const;
+	trace hit(const ray& r, v2 t) const;
+	f32 transmittance(const ray& r, v2 t) const;
+	// True if anything is hit at all; stops at the first hit rather than finding the nearest
+	bool occluded(const ray& r, v2 t) const;
+	bool inside_medium(v3 pos) const;
+
+	// Trees are split in halves, so they're nowhere near this deep
+	static constexpr i32 Max_Stack = 64;
+
+private:
+
+	struct node {
+		enum class type : u8 {
+			node,
+			leaf
+		};
+
+		static i16 populate(const vec<object>& list, prim_store& prims, vec<node>& nodes, 
+							v2 t, i32 leaf_span, std::function<object(vec<object>)> create_leaf);
+
+		aabb box_;
+		type type_ = type::node;
+
+		// Kind of primitive a leaf points to in prims
+		prim leaf = prim::object;
+
+		// Axis the children were sorted along; left holds the lower ones
+		u8 axis = 0;
+
+		// NOTE(max): note-> both populated with bvh::nodes, leaf-> left populated with the index into
+		// prims for its kind, right ignored (leaves just wrap single objects)
+		i16 left = 0, right = 0;
+	};
+
+	void pick_kernel();
+	template<typename K> auto with_leaves(const ray& r, const slab_ray& s, K&& kernel) const;
+	template<typename F> trace closest(const slab_ray& s, v2 t, F&& leaf_hit) const;
+	template<typename F> bool any(const slab_ray& s, v2 t, F&& leaf_hit) const;
+
+	i16 root = -1;
+	prim_store prims;
+	vec<node> nodes;
+
+	// The one kind of leaf in the tree, unless mixed
+	prim leaves = prim::object;
+	bool mixed = true;
+};
+
 struct object_list {
 
 	// NOTE(max): takes ownership
@@ -193,9 +378,13 @@ struct object_list {
 
 	aabb bbox(v2 t) const;
 	trace hit(const ray& r, v2 t) const;
+	f32 transmittance(const ray& r, v2 t) const;
+	bool occluded(const ray& r, v2 t) const;
+	bool inside_medium(v3 pos) const;
 
 private:
-	vec<object> objects;
+	prim_store prims;
+	vec<prim_ref> refs;
 };
 
 struct object {
@@ -210,9 +399,13 @@ struct object {
 		sphere s;
 		sphere_moving sm;
 		sphere_lane sl;
+		sphere_moving_lane sml;
 		rect re;
+		rect_lane rl;
 		box bx;
+		box_lane bl;
 		volume v;
+		volume_grid vg;
 	};
 
 	// NOTE(max): takes ownership
@@ -231,6 +424,12 @@ struct object {
 		ret.re = rect::make(mat, type, u, v, w);
 		return ret;
 	}
+	static object rect_lane(plane type, const f32_lane& mat, const v2_lane& u, const v2_lane& v, const f32_lane& w,
+							m4 t = m4::I) {
+		object ret(obj::rect_lane, t);
+		ret.rl = rect_lane::make(type,u,v,w,mat);
+		return ret;
+	}
 	static object bvh(vec<object> objs, v2 t, m4 tr = m4::I) {
 		object ret(obj::bvh, tr);
 		ret.b = bvh::make(objs, t);
@@ -258,11 +457,29 @@ struct object {
 		ret.sl = sphere_lane::make(pos,rad,mat);
 		return ret;
 	}
+	static object box_lane(const f32_lane& mat, const v3_lane& min, const v3_lane& max, m4 t = m4::I) {
+		object ret(obj::box_lane, t);
+		ret.bl = box_lane::make(min,max,mat);
+		return ret;
+	}
+	static object sphere_moving_lane(const f32_lane& mat, const v3_lane& pos0, const v3_lane& pos1,
+									 const v2_lane& time, const f32_lane& rad, m4 t = m4::I) {
+		object ret(obj::sphere_moving_lane, t);
+		ret.sml = sphere_moving_lane::make(pos0,pos1,time,rad,mat);
+		return ret;
+	}
 	static object volume(i32 phase_mat, f32 density, object* bound, m4 t = m4::I) {
 		object ret(obj::volume, t);
 		ret.v = volume::make(phase_mat, density, bound);
 		return ret;
 	}
+	// NOTE(max): owns a copy of density; only destroy one of the copies of this object
+	static object volume_grid(i32 phase_mat, v3 min, v3 max, i32 rx, i32 ry, i32 rz,
+							  const f32* density, f32 sigma, m4 t = m4::I) {
+		object ret(obj::volume_grid, t);
+		ret.vg = volume_grid::make(phase_mat, min, max, rx, ry, rz, density, sigma);
+		return ret;
+	}
 
 	trace hit(ray r, v2 t) const {
 
@@ -273,11 +490,15 @@ struct object {
 		switch(type) {
 		case obj::bvh: ret = b.hit(r, t); break;
 		case obj::box: ret = bx.hit(r, t); break;
+		case obj::box_lane: ret = bl.hit(r, t); break;
 		case obj::list: ret = l.hit(r, t); break;
 		case obj::rect: ret = re.hit(r, t); break;
+		case obj::rect_lane: ret = rl.hit(r, t); break;
 		case obj::sphere: ret = s.hit(r, t); break;
 		case obj::volume: ret = v.hit(r, t); break;
+		case obj::volume_grid: ret = vg.hit(r, t); break;
 		case obj::sphere_lane: ret = sl.hit(r, t); break;
+		case obj::sphere_moving_lane: ret = sml.hit(r, t); break;
 		case obj::sphere_moving: ret = sm.hit(r, t); break;
 		default: assert(false);
 		}
@@ -286,17 +507,65 @@ struct object {
 
 		return ret;
 	}
+	// Any-hit query, for when only whether something's there matters
+	bool occluded(ray r, v2 t) const {
+
+		switch(type) {
+		case obj::bvh: case obj::list: break;
+		default: return hit(r, t).hit;
+		}
+
+		if(do_trans) r.transform(itrans);
+
+		if(type == obj::bvh) return b.occluded(r, t);
+		return l.occluded(r, t);
+	}
+	// Fraction of light that makes it along r through t; surfaces block it completely.
+	// Affine transforms don't change distances in units of t, so r just goes to object space.
+	f32 transmittance(ray r, v2 t) const {
+
+		switch(type) {
+		case obj::bvh: case obj::list: case obj::volume: case obj::volume_grid: break;
+		default: return hit(r, t).hit ? 0.0f : 1.0f;
+		}
+
+		if(do_trans) r.transform(itrans);
+
+		switch(type) {
+		case obj::bvh: return b.transmittance(r, t);
+		case obj::list: return l.transmittance(r, t);
+		case obj::volume: return v.transmittance(r, t);
+		default: return vg.transmittance(r, t);
+		}
+	}
+	// True if pos is inside a participating medium, i.e. rays from there scatter at random
+	bool inside_medium(v3 pos) const {
+
+		if(do_trans) pos = (itrans * v4(pos, 1.0f)).xyz;
+
+		switch(type) {
+		case obj::bvh: return b.inside_medium(pos);
+		case obj::list: return l.inside_medium(pos);
+		case obj::volume: return v.inside(pos);
+		case obj::volume_grid: return vg.inside(pos);
+		default: return false;
+		}
+	}
 	aabb bbox(v2 t) const {
 
 		aabb ret;
 		switch(type) {
 		case obj::bvh: ret = b.bbox(t); break;
 		case obj::box: ret = bx.bbox(t); break;
+		case obj::box_lane: ret = bl.bbox(t); break;
 		case obj::list: ret = l.bbox(t); break;
 		case obj::rect: ret = re.bbox(t); break;
+		case obj::rect_lane: ret = rl.bbox(t); break;
 		case obj::sphere: ret = s.bbox(t); break;
 		case obj::volume: ret = v.bbox(t); break;
+		case obj::volume_grid: ret = vg.bbox(t); break;
 		case obj::sphere_lane: ret = sl.bbox(t); break;
+		case obj::sphere_moving_lane: ret = sml.bbox(t); break;
 		case obj::sphere_moving: ret = sm.bbox(t); break;
 		default: assert(false);
 		}
@@ -322,10 +591,14 @@ struct object {
 		case obj::bvh: b.destroy(); break;
 		case obj::list: l.destroy(); break;
 		case obj::box: bx.destroy(); break;
+		case obj::box_lane: bl.destroy(); break;
 		case obj::rect: re.destroy(); break;
+		case obj::rect_lane: rl.destroy(); break;
 		case obj::sphere: s.destroy(); break;
 		case obj::volume: v.destroy(); break;
+		case obj::volume_grid: vg.destroy(); break;
 		case obj::sphere_lane: sl.destroy(); break;
+		case obj::sphere_moving_lane: sml.destroy(); break;
 		case obj::sphere_moving: sm.destroy(); break;
 		default: assert(false);
 		}
@@ -348,3 +621,51 @@ private:
 	i32 idx = 0;
 };
 
+// NOTE(max): also takes plain spheres, which just don't move
+struct sphere_moving_lane_builder {
+
+	void clear();
+	void push(i32 m, v3 p0, v3 p1, v2 t, f32 r);
+	void push(object s);
+	void fill();
+	bool done();
+	bool not_empty();
+	object finish();
+
+private:
+	v3_lane pos0, pos1;
+	v2_lane time;
+	f32_lane rad, mat;
+	i32 idx = 0;
+};
+
+struct box_lane_builder {
+
+	void clear();
+	void push(i32 m, v3 min, v3 max);
+	void push(object b);
+	void fill();
+	bool done();
+	bool not_empty();
+	object finish();
+
+private:
+	v3_lane min, max;
+	f32_lane mat;
+	i32 idx = 0;
+};
+
+// NOTE(max): a leaf can hold rects in any of the three planes, so each plane gets its own lane;
+// finish() returns a single rect_lane if only one was used and a list of them otherwise
+struct rect_lane_builder {
+
+	void clear();
+	void push(i32 m, plane type, v2 u, v2 v, f32 w);
+	void push(object r);
+	object finish();
+
+private:
+	v2_lane u[3], v[3];
+	f32_lane w[3], mat[3];
+	i32 idx[3] = {};
+};
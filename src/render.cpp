@@ -1,9 +1,80 @@
 
 #include "render.h"
 
+#include <algorithm>
+#include <tuple>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// NOTE(max): rendering only ever accumulates linear radiance; this is the separate pass that turns
+// it into the 8 bit display/PNG image, and it can be rerun whenever the exposure changes.
+static void tonemap_tile(u32* data, const v3* accum, i32 stride, const tile& t, f32 exposure) {
+
+	if(!t.samples) return;
+	f32 scale = exposure / t.samples;
+
+	for(i32 y = t.y; y < t.y + t.h; y++) {
+		for(i32 x = t.x; x < t.x + t.w; x++) {
+
+			// TODO(max): tone mapping
+			v3 col = pow(clamp(accum[y * stride + x] * scale, 0.0f, 1.0f), 1.0f / 2.2f);
+
+			u8 r = (u8)(col.x * 255.0f);
+			u8 g = (u8)(col.y * 255.0f);
+			u8 b = (u8)(col.z * 255.0f);
+
+			data[y * stride + x] = (0xff << 24) | (b << 16) | (g << 8) | r;
+		}
+	}
+}
+
+// Round to nearest even, with denormals, infinities and NaN
+static u16 f32_to_f16(f32 f) {
+
+	u32 x;
+	memcpy(&x, &f, sizeof(x));
+
+	u32 sign = (x >> 16) & 0x8000;
+	i32 exp = (i32)((x >> 23) & 0xff) - 127 + 15;
+	u32 mant = x & 0x7fffff;
+
+	if(((x >> 23) & 0xff) == 0xff) return (u16)(sign | 0x7c00 | (mant ? 0x200 : 0));
+	if(exp >= 31) return (u16)(sign | 0x7c00);
+
+	if(exp <= 0) {
+		if(exp < -10) return (u16)sign;
+		mant |= 0x800000;
+		u32 shift = 14 - exp;
+		u32 h = mant >> shift;
+		u32 rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+		if(rem > half || (rem == half && (h & 1))) h++;
+		return (u16)(sign | h);
+	}
+
+	u32 h = ((u32)exp << 10) | (mant >> 13);
+	u32 rem = mant & 0x1fff;
+	if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+	return (u16)(sign | h);
+}
+
 bool render_thread(thread_data data) {
 
+	seed_random(((u32)data.y * 0x10000u + (u32)data.x) * 0x9e3779b1u + (u32)data.pass);
+
+	// NOTE(max): the pass is traced into a tile-local buffer and only added to the accumulation
+	// buffer once the whole tile is done, so a cancelled tile leaves the previous passes intact.
+	v3* local = new v3[data.w * data.h]();
+
 	for(i32 y = data.y; y < data.y + data.h; y++) {
+
+		if(data.cancel->load()) {
+			delete[] local;
+			return false;
+		}
+
 		f32 v = (f32)y / data.total_h;
 
 		for(i32 x = data.x; x < data.x + data.w; x++) {
@@ -11,75 +82,277 @@ bool render_thread(thread_data data) {
 
 			v3 col;
 
-			for(i32 s = 0; s < data.s; s++) {
-				col += data.sc->sample({u,v});	
+			if(data.cache) {
+				i32 n = data.grid, patterns = n * n;
+				first_hit* pixel = data.cache + ((u64)y * data.total_w + x) * patterns;
+
+				// Walk the positions in order across passes so each one gets the same share of samples
+				for(i32 s = 0; s < data.s; s++) {
+					i32 k = (data.t->samples + s) % patterns;
+					v2 jit = {((k % n) + 0.5f) / n, ((k / n) + 0.5f) / n};
+					col += data.sc->sample({u,v}, jit, pixel[k]);
+				}
+			} else {
+				for(i32 s = 0; s < data.s; s++) {
+					col += data.sc->sample({u,v});	
+				}
 			}
 
-			// TODO(max): tone mapping
-			col = pow(clamp(col / (f32)data.s, 0.0f, 1.0f), 1.0f / 2.2f);
+			local[(y - data.y) * data.w + x - data.x] = col;
+		}
+	}
 
-			u8 r = (u8)(col.x * 255.0f);
-			u8 g = (u8)(col.y * 255.0f);
-			u8 b = (u8)(col.z * 255.0f);
+	{
+		std::lock_guard<std::mutex> guard(*data.lock);
 
-			data.data[y * data.total_w + x] = (0xff << 24) | (b << 16) | (g << 8) | r;
+		for(i32 y = data.y; y < data.y + data.h; y++) {
+			for(i32 x = data.x; x < data.x + data.w; x++) {
+				data.accum[y * data.total_w + x] += local[(y - data.y) * data.w + x - data.x];
+			}
 		}
+
+		data.t->samples += data.s;
+		data.t->passes++;
+		tonemap_tile(data.data, data.accum, data.total_w, *data.t, *data.exposure);
+		if(data.dirty) data.dirty->push(*data.t);
 	}
 
+	delete[] local;
 	return true;
 }
 
-u64 renderer::begin_render(const scene& s) {
+static u32 morton(u32 x, u32 y) {
+
+	u32 ret = 0;
+	for(u32 i = 0; i < 16; i++) {
+		ret |= ((x >> i) & 1) << (2 * i);
+		ret |= ((y >> i) & 1) << (2 * i + 1);
+	}
+	return ret;
+}
+
+// NOTE(max): https://en.wikipedia.org/wiki/Hilbert_curve#Applications_and_mapping_algorithms
+static u32 hilbert(u32 n, u32 x, u32 y) {
+
+	u32 ret = 0;
+	for(u32 s = n / 2; s > 0; s /= 2) {
+		u32 rx = (x & s) > 0;
+		u32 ry = (y & s) > 0;
+		ret += s * s * ((3 * rx) ^ ry);
+		if(ry == 0) {
+			if(rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			u32 tmp = x;
+			x = y;
+			y = tmp;
+		}
+	}
+	return ret;
+}
+
+// NOTE(max): the sizing is static - the whole plan, including the smaller tail tiles, is made
+// here before anything renders, and tiles are never split once queued. Every tile pass seeds
+// from (tile, pass) and checkpoints store the plan, so splitting based on which tiles happen to
+// be left would make the image depend on timing and break resuming.
+void renderer::plan_tiles(i32 x0, i32 y0, i32 w, i32 h) {
+
+	tiles.clear();
+
+	i32 size = Block_Size;
+	while(size > Min_Block_Size && 
+		  ((w + size - 1) / size) * ((h + size - 1) / size) < Tiles_Per_Thread * threads) {
+		size /= 2;
+	}
+
+	i32 w_blocks = (w + size - 1) / size;
+	i32 h_blocks = (h + size - 1) / size;
+
+	u32 n = 1;
+	while(n < (u32)w_blocks || n < (u32)h_blocks) n *= 2;
+
+	f32 cx = (w_blocks - 1) / 2.0f;
+	f32 cy = (h_blocks - 1) / 2.0f;
+
+	struct keyed {
+		f64 key;
+		tile t;
+	};
+	std::vector<keyed> keyed_tiles;
+
+	for(i32 y = 0; y < h_blocks; y++) {
+		for(i32 x = 0; x < w_blocks; x++) {
+
+			tile t = {x0 + x * size, y0 + y * size, 
+					  min1(size, w - x * size), min1(size, h - y * size)};
+
+			f64 key = 0.0;
+			switch(order) {
+			case tile_order::row: key = y * w_blocks + x; break;
+			case tile_order::morton: key = morton(x, y); break;
+			case tile_order::hilbert: key = hilbert(n, x, y); break;
+			case tile_order::spiral: {
+				// Rings outwards from the center, walking each ring by angle
+				f32 dx = x - cx, dy = y - cy;
+				f32 ring = maxf(fabsf(dx), fabsf(dy));
+				key = ring * 16.0f + (atan2f(dy, dx) + PI32);
+			} break;
+			}
+
+			keyed_tiles.push_back({key, t});
+		}
+	}
+
+	std::stable_sort(keyed_tiles.begin(), keyed_tiles.end(), [](const keyed& l, const keyed& r) {
+		return l.key < r.key;
+	});
+
+	i32 tail = (i32)keyed_tiles.size() - Tail_Tiles_Per_Thread * threads;
+
+	for(i32 i = 0; i < (i32)keyed_tiles.size(); i++) {
+
+		tile t = keyed_tiles[i].t;
+
+		if(i < tail || t.w < 2 * Min_Block_Size || t.h < 2 * Min_Block_Size) {
+			tiles.push(t);
+			continue;
+		}
+
+		i32 hw = t.w / 2, hh = t.h / 2;
+		tiles.push({t.x, t.y, hw, hh});
+		tiles.push({t.x + hw, t.y, t.w - hw, hh});
+		tiles.push({t.x + hw, t.y + hh, t.w - hw, t.h - hh});
+		tiles.push({t.x, t.y + hh, hw, t.h - hh});
+	}
+}
+
+u64 renderer::begin_render(const scene& s, bool resume) {
 
 	u64 start = SDL_GetPerformanceCounter();
 
-	clear();
+	cancel();
 
-	i32 w = width;
-	i32 h = height;
-	i32 x0 = 0, y0 = 0;
-	
-	if(region) {
-		w = r_w;
-		h = r_h;
-		x0 = r_x;
-		y0 = r_y;
+	if(!resume) {
+		if(progressive) {
+			std::lock_guard<std::mutex> guard(accum_lock);
+			memset(accum, 0, width * height * sizeof(v3));
+			tiles.clear();
+		} else {
+			clear();
+		}
+
+		if(region) {
+			plan_tiles(r_x, r_y, r_w, r_h);
+		} else {
+			plan_tiles(0, 0, width, height);
+		}
+
+		pass_samples = progressive ? 1 : max1(1, (samples + Max_Passes - 1) / Max_Passes);
+	}
+
+	// The camera may have moved since the last render, so cached hits never carry over
+	i32 grid = s.fixed_first_hits() ? cache_grid : 0;
+	while(grid > 0 && (u64)width * height * grid * grid * sizeof(first_hit) > Max_First_Hit_Bytes) {
+		grid--;
+	}
+
+	u64 size = (u64)width * height * grid * grid;
+	if(size != cache_size) {
+		delete[] cache;
+		cache = size ? new(std::nothrow) first_hit[size] : null;
+		cache_size = cache ? size : 0;
+		if(size && !cache) {
+			std::cout << "Not enough memory for the first-hit cache, rendering without it." << std::endl;
+		}
+	} else if(cache) {
+		std::fill(cache, cache + cache_size, first_hit());
 	}
+	active_grid = cache ? grid : 0;
 
-	i32 w_blocks = w / Block_Size;
-	i32 h_blocks = h / Block_Size;
-	i32 w_remaining = w % Block_Size;
-	i32 h_remaining = h % Block_Size;
+	render_start = start;
+	deadline = budget > 0.0f ? start + (u64)(budget * SDL_GetPerformanceFrequency()) : 0;
 
 	tasks_complete = 0;
 	total_tasks = 0;
 
-	for(i32 y = 0; y <= h_blocks; y++) {
-		for(i32 x = 0; x <= w_blocks; x++) {
+	i32 needed = 0;
+	for(const tile& ti : tiles) {
+		if(ti.samples < samples) {
+			total_tasks += (samples - ti.samples + pass_samples - 1) / pass_samples;
+			needed++;
+		}
+	}
 
-			thread_data t = {data, &s, x0 + x * Block_Size, y0 + y * Block_Size,
-							 x == w_blocks ? w_remaining : Block_Size, 
-							 y == h_blocks ? h_remaining : Block_Size,
-							 samples, width, height};
+	// NOTE(max): count them all first, so the first tiles to finish can't take outstanding
+	// to zero while the rest are still being queued.
+	outstanding += needed;
+	for(tile& ti : tiles) {
+		if(ti.samples < samples) queue_pass(s, ti);
+	}
 
-			total_tasks++;
+	return start;
+}
+
+void renderer::queue_pass(const scene& s, tile& ti) {
+
+	// After a resume tiles can be a pass apart, so each one carries on from its own count
+	thread_data t = {data, accum, &s, &ti, &cancelled, &accum_lock, &exposure, ogl ? &dirty : null, ti.x, ti.y, ti.w, ti.h, 
+					 min1(pass_samples, samples - ti.samples), ti.passes, width, height, cache, active_grid};
 
 #ifdef USE_THREADING
-			pool.enqueue([t,this] {render_thread(t); tasks_complete++;});
+	pool.enqueue([t,this] {finish_tile(*t.sc, *t.t, render_thread(t));});
 #else
-			render_thread(t);
-			tasks_complete++;
+	finish_tile(s, ti, render_thread(t));
 #endif
+}
+
+void renderer::finish_tile(const scene& s, tile& t, bool done) {
+
+	if(done) {
+		tasks_complete++;
+
+		// The tile won't be touched again, so it can go out while the rest of the frame renders
+		if(stream && t.samples >= samples) {
+			stream_tile(t);
 		}
 	}
 
-	return start;
+	// NOTE(max): each tile queues its own next pass as soon as it's done with this one, so there's
+	// no barrier between passes for threads to idle at. It goes to the back of the queue behind
+	// every other tile's pass, so the frame still fills in evenly. The new pass takes over this
+	// one's count in outstanding, so cancel() never sees zero in between the two.
+	if(done && t.samples < samples && !cancelled.load() && !over_budget()) {
+		queue_pass(s, t);
+	} else {
+		outstanding--;
+	}
+}
+
+bool renderer::over_budget() {
+	return deadline && SDL_GetPerformanceCounter() >= deadline;
+}
+
+void renderer::cancel() {
+
+	if(!in_progress()) return;
+
+	cancelled = true;
+	while(outstanding.load()) {
+		std::this_thread::yield();
+	}
+	cancelled = false;
+
+	tasks_complete = -1;
+	close_stream();
+	commit();
 }
 
 bool renderer::finish() {
 	commit();
-	if(tasks_complete.load() == total_tasks) {
+	if(in_progress() && outstanding.load() == 0) {
 		tasks_complete = -1;
+		close_stream();
 		return true;
 	}
 	return false;
@@ -90,7 +363,12 @@ bool renderer::in_progress() {
 }
 
 f32 renderer::progress() {
-	return (f32)tasks_complete.load() / total_tasks;
+	f32 ret = total_tasks ? (f32)tasks_complete.load() / total_tasks : 1.0f;
+	if(deadline) {
+		f32 elapsed = (f32)(SDL_GetPerformanceCounter() - render_start) / SDL_GetPerformanceFrequency();
+		ret = maxf(ret, minf(elapsed / budget, 1.0f));
+	}
+	return ret;
 }
 
 void renderer::set_region(bool enable, i32 x, i32 y, i32 w, i32 h) {
@@ -105,48 +383,502 @@ void renderer::set_region(bool enable, i32 x, i32 y, i32 w, i32 h) {
 	r_h = h;
 }
 
-void renderer::init(i32 w, i32 h, i32 s, bool use_ogl) {
+void renderer::set_order(tile_order o) {
+	order = o;
+}
+
+void renderer::set_budget(f32 seconds) {
+	budget = seconds;
+}
+
+void renderer::set_progressive(bool enable) {
+	progressive = enable;
+}
+
+void renderer::set_first_hit_cache(i32 grid) {
+	cache_grid = max1(min1(grid, Max_First_Hit_Grid), 0);
+}
+
+void renderer::init(i32 w, i32 h, i32 s, bool use_ogl, i32 t) {
 	
 	width = w;
 	height = h;
 	samples = s;
+	threads = t > 0 ? t : SDL_GetCPUCount();
 
 	data = new u32[width*height]();
+	accum = new v3[width*height]();
 
 	ogl = use_ogl;
 	if(ogl) {
 		glGenTextures(1, &handle);
+		glBindTexture(GL_TEXTURE_2D, handle);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, null);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glGenBuffers(2, pbos);
+		dirty_all = true;
 		commit();
 	}
 
-	pool.start(SDL_GetCPUCount());
+	pool.start(threads);
 }
 
 void renderer::destroy() {
+	cancel();
+	close_stream();
 	pool.finish();
 	delete[] data;
+	delete[] accum;
+	delete[] cache;
 	data = null;
+	accum = null;
+	cache = null;
+	cache_size = 0;
+	tiles.destroy();
+	dirty.destroy();
+	delete[] staging;
+	staging = null;
+	staging_size = 0;
 	if(ogl && handle) glDeleteTextures(1, &handle);
+	if(ogl && pbos[0]) glDeleteBuffers(2, pbos);
+	pbos[0] = pbos[1] = 0;
 	width = height = handle = 0;
 }
 
 renderer::~renderer() {
-	pool.kill(); 
 	destroy();
 }
 
-void renderer::write_to_file(std::string file) {
-	stbi_write_png(file.c_str(), width, height, 4, data, width * sizeof(u32));
+void renderer::resize(i32 w, i32 h, i32 s) {
+
+	cancel();
+	close_stream();
+
+	samples = s;
+
+	if(w != width || h != height) {
+		width = w;
+		height = h;
+
+		delete[] data;
+		delete[] accum;
+		data = new u32[width*height]();
+		accum = new v3[width*height]();
+
+		if(ogl) {
+			glBindTexture(GL_TEXTURE_2D, handle);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, null);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+	}
+
+	clear();
+	commit();
+}
+
+static bool ends_with(const std::string& str, const std::string& end) {
+	return str.size() >= end.size() && str.compare(str.size() - end.size(), end.size(), end) == 0;
+}
+
+bool renderer::write_to_file(std::string file, png_level level) {
+	if(ends_with(file, ".pfm")) return write_pfm(file);
+	if(ends_with(file, ".dwt")) return write_tiled(file);
+	return write_png(file, level);
+}
+
+bool renderer::write_png(std::string file, png_level level) {
+	return png_write(file, (u8*)data, width, height, level, &pool);
+}
+
+void renderer::linear_tile(const tile& t, f32* out) {
+
+	f32 scale = t.samples ? 1.0f / t.samples : 0.0f;
+
+	for(i32 y = t.y; y < t.y + t.h; y++) {
+		for(i32 x = t.x; x < t.x + t.w; x++) {
+			v3 col = accum[y * width + x] * scale;
+			*out++ = col.x;
+			*out++ = col.y;
+			*out++ = col.z;
+		}
+	}
+}
+
+bool renderer::write_pfm(std::string file) {
+
+	// Pixels outside of every tile (e.g. outside the region) stay black
+	f32* pixels = new f32[width * height * 3]();
+	std::vector<f32> buf;
+	{
+		std::lock_guard<std::mutex> guard(accum_lock);
+		for(const tile& t : tiles) {
+			buf.resize(t.w * t.h * 3);
+			linear_tile(t, buf.data());
+			for(i32 y = 0; y < t.h; y++) {
+				memcpy(pixels + ((t.y + y) * width + t.x) * 3, buf.data() + y * t.w * 3, t.w * 3 * sizeof(f32));
+			}
+		}
+	}
+
+	bool ok = false;
+	FILE* f = fopen(file.c_str(), "wb");
+	if(f) {
+		// NOTE(max): negative scale means little endian; PFM rows go bottom to top
+		ok = fprintf(f, "PF\n%d %d\n-1.0\n", width, height) > 0;
+		for(i32 y = height - 1; ok && y >= 0; y--) {
+			ok = fwrite(pixels + y * width * 3, sizeof(f32) * 3, width, f) == (size_t)width;
+		}
+		ok = fclose(f) == 0 && ok;
+	}
+
+	delete[] pixels;
+	return ok;
+}
+
+bool renderer::write_record(FILE* f, const tile& t) {
+
+	std::vector<f32> pixels(t.w * t.h * 3);
+	std::vector<u16> halves(t.w * t.h * 3);
+
+	linear_tile(t, pixels.data());
+	for(size_t i = 0; i < pixels.size(); i++) {
+		halves[i] = f32_to_f16(pixels[i]);
+	}
+
+	tile_record record = {t.x, t.y, t.w, t.h};
+	return fwrite(&record, sizeof(record), 1, f) == 1 &&
+		   fwrite(halves.data(), sizeof(u16), halves.size(), f) == halves.size();
+}
+
+bool renderer::write_tiled(std::string file) {
+
+	FILE* f = fopen(file.c_str(), "wb");
+	if(!f) return false;
+
+	tiled_header header;
+	header.width = width;
+	header.height = height;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	{
+		std::lock_guard<std::mutex> guard(accum_lock);
+		for(i32 i = 0; ok && i < tiles.size; i++) {
+			if(tiles[i].samples) ok = write_record(f, tiles[i]);
+		}
+	}
+
+	ok = fclose(f) == 0 && ok;
+	return ok;
+}
+
+bool renderer::set_stream(std::string file) {
+
+	close_stream();
+
+	if(file == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		stream = stdout;
+	} else {
+		stream = fopen(file.c_str(), "wb");
+	}
+	if(!stream) return false;
+
+	tiled_header header;
+	header.width = width;
+	header.height = height;
+	stream_ok = fwrite(&header, sizeof(header), 1, stream) == 1;
+	return stream_ok;
+}
+
+void renderer::stream_tile(const tile& t) {
+
+	std::lock_guard<std::mutex> guard(stream_lock);
+	if(!stream || !stream_ok) return;
+
+	// Flush every record so whoever is reading the pipe gets the tile right away
+	stream_ok = write_record(stream, t) && fflush(stream) == 0;
+}
+
+bool renderer::close_stream() {
+
+	if(!stream) return true;
+
+	// Tiles that stopped short of the full sample count (cancel or budget) haven't been sent yet
+	for(const tile& t : tiles) {
+		if(t.samples && t.samples < samples) stream_tile(t);
+	}
+
+	bool ok = stream_ok;
+	if(stream == stdout) {
+		ok = fflush(stream) == 0 && ok;
+	} else {
+		ok = fclose(stream) == 0 && ok;
+	}
+	stream = null;
+	stream_ok = false;
+	return ok;
+}
+
+void renderer::set_exposure(f32 stops) {
+	std::lock_guard<std::mutex> guard(accum_lock);
+	exposure = exp2f(stops);
+}
+
+void renderer::tonemap() {
+	{
+		std::lock_guard<std::mutex> guard(accum_lock);
+		for(const tile& t : tiles) {
+			tonemap_tile(data, accum, width, t, exposure);
+		}
+		dirty_all = true;
+	}
+	commit();
+}
+
+bool renderer::save_checkpoint(std::string file, const scene& s) {
+
+	checkpoint_header header;
+	header.width = width;
+	header.height = height;
+	header.pass_samples = pass_samples;
+	header.tiles = tiles.size;
+	header.samples = samples;
+	header.cache_grid = cache_grid;
+	header.scene_key = s.key();
+
+	// Snapshot under the lock so we never write half of a pass, then write without it
+	tile* t = new tile[tiles.size];
+	v3* a = new v3[width * height];
+	{
+		std::lock_guard<std::mutex> guard(accum_lock);
+		memcpy(t, tiles.data, tiles.size * sizeof(tile));
+		memcpy(a, accum, width * height * sizeof(v3));
+	}
+
+	// NOTE(max): write next to the old checkpoint and swap it in, so dying mid-write
+	// still leaves the previous one intact.
+	std::string temp = file + ".tmp";
+	bool ok = false;
+
+	FILE* f = fopen(temp.c_str(), "wb");
+	if(f) {
+		ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+			 fwrite(t, sizeof(tile), tiles.size, f) == (size_t)tiles.size &&
+			 fwrite(a, sizeof(v3), width * height, f) == (size_t)(width * height);
+		ok = fclose(f) == 0 && ok;
+	}
+
+	delete[] t;
+	delete[] a;
+
+	if(ok) {
+		remove(file.c_str());
+		ok = rename(temp.c_str(), file.c_str()) == 0;
+	}
+	return ok;
+}
+
+bool renderer::load_checkpoint(std::string file, const scene& s) {
+
+	cancel();
+
+	FILE* f = fopen(file.c_str(), "rb");
+	if(!f) return false;
+
+	checkpoint_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != checkpoint_header::Magic ||
+	   header.version != checkpoint_header::Version || header.width != width || 
+	   header.height != height || header.tiles <= 0 || header.pass_samples <= 0 || header.samples <= 0) {
+		fclose(f);
+		return false;
+	}
+
+	// NOTE(max): accumulating on top of a different scene (or camera, or environment...) would
+	// silently blend two images, and fewer samples or a different first-hit grid would change how
+	// the remaining passes are laid out. Only topping up with more samples is allowed.
+	if(header.scene_key != s.key() || header.cache_grid != cache_grid || header.samples > samples) {
+		std::cout << "Checkpoint " << file << " was made with different scene or render settings!" << std::endl;
+		fclose(f);
+		return false;
+	}
+
+	clear();
+
+	bool ok = true;
+	for(i32 i = 0; ok && i < header.tiles; i++) {
+		tile t;
+		ok = fread(&t, sizeof(tile), 1, f) == 1 && t.x >= 0 && t.y >= 0 && t.w > 0 && t.h > 0 &&
+			 t.x + t.w <= width && t.y + t.h <= height && t.samples >= 0 && t.passes >= 0;
+		tiles.push(t);
+	}
+	ok = ok && fread(accum, sizeof(v3), width * height, f) == (size_t)(width * height);
+	fclose(f);
+
+	if(!ok) {
+		clear();
+		return false;
+	}
+
+	pass_samples = header.pass_samples;
+	for(const tile& t : tiles) {
+		tonemap_tile(data, accum, width, t, exposure);
+	}
+	dirty_all = true;
+	commit();
+
+	return true;
+}
+
+void renderer::export_region(i32 x, i32 y, i32 w, i32 h, v3* out) {
+
+	std::lock_guard<std::mutex> guard(accum_lock);
+
+	for(const tile& t : tiles) {
+
+		// Only whole tiles inside the region; tiles are planned per region so this is all of them
+		if(t.x < x || t.y < y || t.x + t.w > x + w || t.y + t.h > y + h) continue;
+
+		f32 total = t.samples ? (f32)t.samples : 1.0f;
+		for(i32 ty = t.y; ty < t.y + t.h; ty++) {
+			for(i32 tx = t.x; tx < t.x + t.w; tx++) {
+				out[(ty - y) * w + tx - x] = accum[ty * width + tx] / total;
+			}
+		}
+	}
+}
+
+void renderer::import_region(i32 x, i32 y, i32 w, i32 h, const v3* in) {
+
+	assert(x >= 0 && y >= 0 && x + w <= width && y + h <= height);
+
+	std::lock_guard<std::mutex> guard(accum_lock);
+
+	// NOTE(max): stored as if it were rendered here with the full sample count, so it counts as a
+	// finished tile for streaming and checkpoints.
+	for(i32 ty = y; ty < y + h; ty++) {
+		for(i32 tx = x; tx < x + w; tx++) {
+			accum[ty * width + tx] = in[(ty - y) * w + tx - x] * (f32)samples;
+		}
+	}
+
+	tile t = {x, y, w, h, samples, 1};
+	tiles.push(t);
+	tonemap_tile(data, accum, width, t, exposure);
+	if(ogl) dirty.push(t);
+
+	if(stream) {
+		stream_tile(t);
+	}
 }
 
 void renderer::clear() {
+	std::lock_guard<std::mutex> guard(accum_lock);
 	memset(data, 0, width * height * sizeof(u32));	
+	memset(accum, 0, width * height * sizeof(v3));
+	tiles.clear();
+	dirty.clear();
+	dirty_all = true;
 }
 
 void renderer::commit() {
+
 	if(!ogl) return;
+
+	vec<tile> uploads;
+	u64 bytes = 0;
+	{
+		std::lock_guard<std::mutex> guard(accum_lock);
+		if(!dirty_all && !dirty.size) return;
+
+		uploads = vec<tile>::take(dirty);
+		bool all = dirty_all;
+		dirty_all = false;
+
+		// A tile that finished more than once since the last commit only needs uploading once
+		auto rect = [](const tile& t) { return std::make_tuple(t.y, t.x, t.h, t.w); };
+		std::sort(uploads.begin(), uploads.end(), [&](const tile& a, const tile& b) {
+			return rect(a) < rect(b);
+		});
+		i32 unique = 0;
+		for(const tile& t : uploads) {
+			if(unique && rect(uploads[unique - 1]) == rect(t)) continue;
+			uploads[unique++] = t;
+		}
+		uploads.size = unique;
+
+		u64 full = (u64)width * height * sizeof(u32);
+		for(const tile& t : uploads) {
+			bytes += (u64)t.w * t.h * sizeof(u32);
+		}
+		if(all || bytes >= full) {
+			uploads.clear();
+			uploads.push({0, 0, width, height});
+			bytes = full;
+		}
+
+		if(staging_size < bytes) {
+			delete[] staging;
+			staging = new u32[full / sizeof(u32)];
+			staging_size = full;
+		}
+
+		u32* dst = staging;
+		for(const tile& t : uploads) {
+			for(i32 y = t.y; y < t.y + t.h; y++) {
+				memcpy(dst, data + y * width + t.x, t.w * sizeof(u32));
+				dst += t.w;
+			}
+		}
+	}
+
+	// Orphan the buffer so the driver can hand us fresh memory instead of syncing
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pbo_index]);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, null, GL_STREAM_DRAW);
+	u8* dst = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, 
+									GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if(dst) {
+		memcpy(dst, staging, bytes);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	} else {
+		// Try again next time; the pixels are still in data
+		uploads.destroy();
+		std::lock_guard<std::mutex> guard(accum_lock);
+		dirty_all = true;
+	}
+
+	if(uploads.size) {
+		glBindTexture(GL_TEXTURE_2D, handle);
+
+		uptr offset = 0;
+		for(const tile& t : uploads) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, t.x, t.y, t.w, t.h, GL_RGBA, GL_UNSIGNED_BYTE, (void*)offset);
+			offset += (uptr)t.w * t.h * sizeof(u32);
+		}
+		if(mipmaps) {
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		uploads.destroy();
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	pbo_index = 1 - pbo_index;
+}
+
+void renderer::set_mipmaps(bool enable) {
+
+	mipmaps = enable;
+	if(!ogl) return;
+
 	glBindTexture(GL_TEXTURE_2D, handle);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	if(mipmaps) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
 	glBindTexture(GL_TEXTURE_2D, 0);
 }
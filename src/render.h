@@ -6,47 +6,206 @@
 #include <stb_image_write.h>
 
 #include "lib/thread_pool.h"
+#include "lib/png.h"
 #include "scene.h"
 
+struct tile {
+	i32 x = 0, y = 0, w = 0, h = 0;
+	i32 samples = 0, passes = 0;
+};
+
 struct thread_data {
 	u32* data = null;
+	v3* accum = null;
 	scene const* sc = null;
-	i32 x,y,w,h,s;
+	tile* t = null;
+	std::atomic<bool> const* cancel = null;
+	std::mutex* lock = null;
+	f32 const* exposure = null;
+	vec<tile>* dirty = null;
+	i32 x,y,w,h,s,pass;
 	i32 total_w, total_h;
+	first_hit* cache = null;
+	i32 grid = 0;
 };
 
 bool render_thread(thread_data data);
 
+enum class tile_order : u8 {
+	row,
+	morton,
+	hilbert,
+	spiral
+};
+
+static const char* const tile_order_names[] = {"row", "morton", "hilbert", "spiral"};
+
+// NOTE(max): a checkpoint is this header, then the tile plan (with how many samples each tile
+// has), then the raw accumulation buffer. Sampler state isn't stored - every tile pass reseeds
+// from (tile, pass), so resuming gives the same image as an uninterrupted run. The sample count,
+// first-hit grid and scene key have to match for that to hold, so resuming checks them.
+struct checkpoint_header {
+	static const u32 Magic = 0x4b434e44; // "DNCK"
+	static const u32 Version = 2;
+
+	u32 magic = Magic;
+	u32 version = Version;
+	i32 width = 0, height = 0;
+	i32 pass_samples = 0, tiles = 0;
+	i32 samples = 0, cache_grid = 0;
+	u64 scene_key = 0;
+};
+
+// NOTE(max): .dwt files are this header, then any number of tile records in any order until the
+// end of the file. Each record is a tile_record followed by w*h RGB half floats, row by row, of
+// linear radiance with no exposure applied.
+struct tiled_header {
+	static const u32 Magic = 0x4c545744; // "DWTL"
+	static const u32 Version = 1;
+
+	u32 magic = Magic;
+	u32 version = Version;
+	i32 width = 0, height = 0;
+};
+
+struct tile_record {
+	i32 x = 0, y = 0, w = 0, h = 0;
+};
+
 struct renderer {
 	
-	void init(i32 w, i32 h, i32 samples, bool use_ogl = true);
+	// threads = 0 renders on every core
+	void init(i32 w, i32 h, i32 samples, bool use_ogl = true, i32 threads = 0);
 	void destroy();
 	~renderer();
 
+	// Cancels any render and changes the resolution and sample count in place. The thread pool
+	// and GL objects are kept, and the buffers are only reallocated if the size changed.
+	void resize(i32 w, i32 h, i32 samples);
+
 	void set_region(bool enable, i32 x, i32 y, i32 w, i32 h);
-	u64 begin_render(const scene& s);
+	void set_order(tile_order o);
+	void set_budget(f32 seconds);
+
+	// Progressive renders take one sample per pass and keep showing the previous image until
+	// tiles are overwritten, so restarting on every camera move stays smooth.
+	void set_progressive(bool enable);
+
+	// NOTE(max): with grid > 0 and a scene whose first hits are fixed (see scene::fixed_first_hits),
+	// each pixel is sampled at grid x grid fixed sub-pixel positions whose primary hits are traced
+	// once and reused for the rest of the render. Costs sizeof(first_hit) * grid^2 bytes per pixel;
+	// 0 turns it off. grid is clamped to Max_First_Hit_Grid, and a render drops to a smaller grid
+	// (or none) if the cache would go over Max_First_Hit_Bytes or can't be allocated.
+	void set_first_hit_cache(i32 grid);
+	static const i32 Max_First_Hit_Grid = 4;
+	static const u64 Max_First_Hit_Bytes = 1ull << 30;
+	u64 begin_render(const scene& s, bool resume = false);
+	void cancel();
 	bool finish();
 	bool in_progress();
 	f32 progress();
 
-	void write_to_file(std::string file);
+	// Writes by extension: .pfm and .dwt keep linear float data, anything else is a tone mapped PNG
+	bool write_to_file(std::string file, png_level level = png_level::fast);
+	bool write_png(std::string file, png_level level = png_level::fast);
+	bool write_pfm(std::string file);
+	bool write_tiled(std::string file);
+
+	// Streams finished tiles as .dwt records to file ("-" for stdout) during the next render;
+	// the stream is closed when that render finishes or is cancelled.
+	bool set_stream(std::string file);
+	bool close_stream();
+
+	// Exposure in stops; only changes the tone mapped image, so it can be adjusted after a render
+	void set_exposure(f32 stops);
+	void tonemap();
+
+	// Resuming refuses checkpoints of a different scene or settings; raising the sample count is
+	// the one change allowed, and just adds samples to the image.
+	bool save_checkpoint(std::string file, const scene& s);
+	bool load_checkpoint(std::string file, const scene& s);
+
+	// Mean linear color per pixel, for merging regions rendered elsewhere
+	void export_region(i32 x, i32 y, i32 w, i32 h, v3* out);
+	void import_region(i32 x, i32 y, i32 w, i32 h, const v3* in);
 	void clear();
+
+	// Uploads only the tiles that changed since the last commit
 	void commit();
 
+	// Off by default; the viewer only needs mips when the image is drawn smaller than it is
+	void set_mipmaps(bool enable);
+
 	GLuint handle = 0;
 
 private:
 	i32 width = 0, height = 0, samples = 0;
 	u32* data = nullptr;
+	v3* accum = nullptr;
 
 	bool region = false;
 	i32 r_x = 0, r_y = 0, r_w = 0, r_h = 0;
 
-	bool ogl = true;
+	bool ogl = true, progressive = false;
+
+	// NOTE(max): tiles are marked dirty under accum_lock when their pixels change. commit() only
+	// copies those pixels into staging while holding the lock, then moves them into one of two
+	// pixel unpack buffers and updates the texture from it without the lock, alternating buffers
+	// so we never wait on the driver still reading the previous frame's buffer.
+	vec<tile> dirty;
+	bool dirty_all = false, mipmaps = false;
+	GLuint pbos[2] = {};
+	i32 pbo_index = 0;
+	u32* staging = null;
+	u64 staging_size = 0;
+
+	void plan_tiles(i32 x0, i32 y0, i32 w, i32 h);
+	void linear_tile(const tile& t, f32* out);
+	bool write_record(FILE* f, const tile& t);
+	void stream_tile(const tile& t);
+	void queue_pass(const scene& s, tile& t);
+	void finish_tile(const scene& s, tile& t, bool done);
+	bool over_budget();
 
+	// NOTE(max): tiles start at Block_Size and shrink down to Min_Block_Size until there are at
+	// least Tiles_Per_Thread per thread. The last Tail_Tiles_Per_Thread * threads tiles in the
+	// order are then split into quarters so the end of the frame doesn't leave cores idle. All of
+	// this is decided up front in plan_tiles; see there for why nothing is split mid-render.
 	static const i32 Block_Size = 32;
+	static const i32 Min_Block_Size = 8;
+	static const i32 Tiles_Per_Thread = 16;
+	static const i32 Tail_Tiles_Per_Thread = 2;
+
+	// NOTE(max): each tile's samples are split into at most Max_Passes passes, and the budget is
+	// checked before a tile queues its next one. Every tile gets its first pass, so a budgeted
+	// render always stops on a complete (if noisier) image, and a cancelled one keeps every pass
+	// that finished.
+	static const i32 Max_Passes = 16;
+
+	tile_order order = tile_order::morton;
+	vec<tile> tiles;
+
+	// What was asked for, and what the current render could actually fit
+	i32 cache_grid = 0, active_grid = 0;
+	first_hit* cache = null;
+	u64 cache_size = 0;
+
+	f32 budget = 0.0f, exposure = 1.0f;
+	u64 render_start = 0, deadline = 0;
+	i32 pass_samples = 0;
+
+	// Guards accum, data, dirty, exposure, and the tile sample counts so checkpoints see whole passes
+	std::mutex accum_lock;
+	std::atomic<bool> cancelled = false;
+
+	std::mutex stream_lock;
+	FILE* stream = null;
+	bool stream_ok = false;
+
+	std::atomic<i32> outstanding = 0;
 	std::atomic<i32> tasks_complete = -1;
 	i32 total_tasks = 0;
+	i32 threads = 1;
 	thread_pool pool;
 
 };
@@ -15,6 +15,14 @@ void camera::init(v3 p, v3 l, i32 w, i32 h, f32 f, f32 ap, v2 t) {
 	update();
 }
 
+void camera::resize(i32 w, i32 h) {
+	wid = w;
+	hei = h;
+	ar = (f32)hei / wid;
+
+	update();
+}
+
 void camera::update() {
 	f32 half_w = tan(fov / 2.0f);
 	f32 half_h = ar * half_w;
@@ -30,6 +38,53 @@ void camera::update() {
 
 	horz_step = 2.0f*half_w*focus*right;
 	vert_step = -2.0f*half_h*focus*up;
+
+	// Angle covered by one pixel, which is how fast primary ray cones grow
+	spread = 2.0f*half_w / wid;
+}
+
+void camera::orbit(f32 yaw, f32 pitch) {
+
+	v3 off = pos - look;
+	f32 r = len(off);
+
+	// Stop just short of the poles, where the basis built from world up degenerates
+	f32 p = clamp(asinf(off.y / r) + pitch, -1.5f, 1.5f);
+	f32 y = atan2f(off.z, off.x) + yaw;
+
+	pos = look + r * v3(cosf(p) * cosf(y), sinf(p), cosf(p) * sinf(y));
+	update();
+}
+
+void camera::pan(f32 x, f32 y) {
+
+	// Scaled by the focus distance so dragging feels the same at any zoom
+	f32 focus = len(pos - look);
+	v3 delta = focus * (x * right + y * up);
+
+	pos += delta;
+	look += delta;
+	update();
+}
+
+void camera::dolly(f32 factor) {
+
+	v3 off = pos - look;
+	f32 r = maxf(len(off) * factor, 0.01f);
+
+	pos = look + norm(off) * r;
+	update();
+}
+
+void camera::move(v3 local) {
+
+	// local is (right, up, forward) in units of the focus distance
+	f32 focus = len(pos - look);
+	v3 delta = focus * (local.x * right + local.y * up - local.z * forward);
+
+	pos += delta;
+	look += delta;
+	update();
 }
 
 ray camera::get_ray(v2 uv, v2 jit) const {
@@ -41,42 +96,151 @@ ray camera::get_ray(v2 uv, v2 jit) const {
 	f32 ray_time = lerp(time.x, time.y, randomf());
 	v3 lens_pos = aperture * random_ledisk();
 	v3 offset = pos + right * lens_pos.x + up * lens_pos.y;
-	return {offset, lower_left + uv.x*horz_step + uv.y*vert_step - offset, ray_time};
+	ray ret = {offset, lower_left + uv.x*horz_step + uv.y*vert_step - offset, ray_time};
+	ret.spread = spread;
+	return ret;
 }
 
 scene::~scene() {
 	destroy();
 }
 
-void scene::init(i32 w, i32 h) {
+void scene::init(i32 w, i32 h, bool bake_noise, scene_kind k) {
 
 	g_perlin.init();
 
-	scene_obj = def.init(w, h);
+	kind = k;
+	showcase.bake_noise = bake_noise;
+
+#define BUILD(s) scene_obj = s.init(w, h); view = &s.cam; mats = &s.mats;
+	switch(kind) {
+	case scene_kind::showcase: BUILD(showcase); break;
+	case scene_kind::random_bvh: BUILD(random_bvh); break;
+	case scene_kind::basic: BUILD(basic); break;
+	case scene_kind::cornell: BUILD(cornell); break;
+	case scene_kind::planet: BUILD(planet); break;
+	case scene_kind::smoke: BUILD(smoke); break;
+	case scene_kind::moving: BUILD(moving); break;
+	}
+#undef BUILD
 }
 
 void scene::destroy() {
 	scene_obj.destroy();
-	def.destroy();
+	if(view) {
+		switch(kind) {
+		case scene_kind::showcase: showcase.destroy(); break;
+		case scene_kind::random_bvh: random_bvh.destroy(); break;
+		case scene_kind::basic: basic.destroy(); break;
+		case scene_kind::cornell: cornell.destroy(); break;
+		case scene_kind::planet: planet.destroy(); break;
+		case scene_kind::smoke: smoke.destroy(); break;
+		case scene_kind::moving: moving.destroy(); break;
+		}
+	}
+	view = null;
+	mats = null;
+	env.destroy();
+	env_file.clear();
+}
+
+bool scene::set_environment(std::string file, f32 intensity) {
+	env.destroy();
+	env_file = file;
+	env_intensity = intensity;
+	if(!file.empty()) {
+		env = environment::make(file, intensity);
+	}
+	return file.empty() || env.valid();
+}
+
+// FNV-1a
+static u64 hash_bytes(u64 h, const void* data, u64 size) {
+	const u8* bytes = (const u8*)data;
+	for(u64 i = 0; i < size; i++) {
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return h;
 }
 
-v3 scene::compute(const ray& r_) const {
+u64 scene::key() const {
+
+	const camera& c = *view;
+	f32 cam[] = {c.pos.x, c.pos.y, c.pos.z, c.look.x, c.look.y, c.look.z, c.fov, c.aperture, c.time.x, c.time.y};
+	i32 ints[] = {c.wid, c.hei, showcase.bake_noise, (i32)kind};
+
+	u64 h = 0xcbf29ce484222325ull;
+	h = hash_bytes(h, cam, sizeof(cam));
+	h = hash_bytes(h, ints, sizeof(ints));
+	h = hash_bytes(h, env_file.data(), env_file.size());
+	h = hash_bytes(h, &env_intensity, sizeof(env_intensity));
+	return h;
+}
+
+void scene::resize(i32 w, i32 h) {
+	view->resize(w, h);
+}
+
+v3 scene::compute(const ray& r) const {
+	return shade(r, scene_obj.hit(r, {0.001f, FLT_MAX}));
+}
+
+v3 scene::shade(const ray& r_, trace t) const {
 	
 	ray r = r_;
 	i32 depth = 0;
 
 	v3 accum(0.0f), attn(1.0f);
+
+	// Density the last bounce had for r if it also sampled the environment directly, else 0
+	f32 bsdf_pdf = 0.0f;
 	
 	while(depth < max_depth) {
 		
-		trace t = scene_obj.hit(r, {0.001f, FLT_MAX});
+		if(depth) t = scene_obj.hit(r, {0.001f, FLT_MAX});
 		if(t.hit) {
 
-			scatter s = def.mats.get(t.mat)->bsdf(r, t);
+			// NOTE(max): the cone only grows with distance; bounces don't widen it, which keeps
+			// textures seen through glossy or diffuse paths sharper than they strictly need to be.
+			f32 dir_len = len(r.dir);
+			f32 width = r.cone + r.spread * t.t * dir_len;
+			f32 cos_theta = maxf(fabsf(dot(r.dir, t.normal)) / dir_len, Min_Cone_Cos);
+			t.footprint = width * t.uv_scale / cos_theta;
+
+			const material* m = mats->get(t.mat);
+			scatter s = m->bsdf(r, t);
 
 			accum += attn * s.emitted;
+
+			bsdf_pdf = 0.0f;
+			bool lambertian = m->type == mat::lambertian, isotropic = m->type == mat::isotropic;
+			if(env.valid() && (lambertian || isotropic) && !s.absorbed) {
+
+				// NOTE(max): next event estimation, MIS'd against the bounce with the power
+				// heuristic. The lambertian bounce is cosine distributed (see lambertian::bsdf) and
+				// isotropic media scatter uniformly, so those are the bounce's pdfs.
+				// Shadow rays pick up how much of the light gets through any media on the way.
+				f32 light_pdf = 0.0f;
+				v3 wi = env.sample(light_pdf);
+				f32 pdf = lambertian ? dot(t.normal, wi) / PI32 : 1.0f / (4.0f * PI32);
+
+				if(pdf > 0.0f && light_pdf > 0.0f) {
+					ray shadow = {t.pos, wi, r.t};
+					f32 vis = scene_obj.transmittance(shadow, {0.001f, FLT_MAX});
+					if(vis > 0.0f) {
+						f32 weight = light_pdf * light_pdf / (light_pdf * light_pdf + pdf * pdf);
+						accum += attn * s.attenuation * env.eval(wi) * (vis * pdf * weight / light_pdf);
+					}
+				}
+
+				bsdf_pdf = lambertian ? maxf(dot(t.normal, norm(s.out.dir)), 0.0f) / PI32 : 1.0f / (4.0f * PI32);
+			}
+
 			attn *= s.attenuation;
+			f32 spread = r.spread;
 			r = s.out;
+			r.cone = width;
+			r.spread = spread;
 
 			if(s.absorbed) {
 				return accum;
@@ -84,6 +248,14 @@ v3 scene::compute(const ray& r_) const {
 
 		} else {
 
+			if(env.valid()) {
+				f32 weight = 1.0f;
+				if(bsdf_pdf > 0.0f) {
+					f32 light_pdf = env.pdf(r.dir);
+					weight = bsdf_pdf * bsdf_pdf / (bsdf_pdf * bsdf_pdf + light_pdf * light_pdf);
+				}
+				accum += attn * env.eval(r.dir) * weight;
+			}
 			return accum;
 		}
 
@@ -93,16 +265,73 @@ v3 scene::compute(const ray& r_) const {
 	return accum;
 }
 
+camera& scene::cam() {
+	return *view;
+}
+
 v3 scene::sample(v2 uv) const {
 		
 	v2 jit = {randomf(), randomf()};
-	ray r = def.cam.get_ray(uv, jit);
+	ray r = view->get_ray(uv, jit);
 		
 	v3 result = safe(compute(r));
 
 	return result;
 }
 
+bool scene::fixed_first_hits() const {
+
+	// NOTE(max): from inside a medium every primary ray picks a random scattering distance, so
+	// nothing would ever be served from the cache and it'd only cost memory and random jitter
+	return view->aperture == 0.0f && view->time.x == view->time.y &&
+		   !scene_obj.inside_medium(view->pos);
+}
+
+v3 scene::sample(v2 uv, v2 jit, first_hit& cache) const {
+
+	// Nothing to reuse, so sample it like an uncached pixel
+	if(cache.mat == first_hit::Random) {
+		return sample(uv);
+	}
+
+	ray r = view->get_ray(uv, jit);
+
+	if(cache.mat == first_hit::Unknown) {
+
+		rand_state before = __state;
+		trace t = scene_obj.hit(r, {0.001f, FLT_MAX});
+
+		// Volumes pick a random scattering distance, so caching what they returned would freeze
+		// the noise per sub-sample. Anything that drew random numbers gets traced every time.
+		if(before.x != __state.x || before.y != __state.y || before.z != __state.z) {
+			cache.mat = first_hit::Random;
+		} else if(!t.hit) {
+			cache.mat = first_hit::Miss;
+		} else {
+			cache.mat = t.mat;
+			cache.t = t.t;
+			cache.uv = t.uv;
+			cache.uv_scale = t.uv_scale;
+			cache.normal[0] = t.normal.x;
+			cache.normal[1] = t.normal.y;
+			cache.normal[2] = t.normal.z;
+		}
+		return safe(shade(r, t));
+	}
+
+	trace t;
+	if(cache.mat != first_hit::Miss) {
+		t.hit = true;
+		t.mat = cache.mat;
+		t.t = cache.t;
+		t.uv = cache.uv;
+		t.uv_scale = cache.uv_scale;
+		t.pos = r.get(t.t);
+		t.normal = v3(cache.normal[0], cache.normal[1], cache.normal[2]);
+	}
+	return safe(shade(r, t));
+}
+
 void random_bvh_scene::destroy() {
 	mats.destroy();
 	cam = {};
@@ -178,6 +407,62 @@ object random_bvh_scene::init(i32 w, i32 h) {
 	return ret;
 }
 
+void moving_scene::destroy() {
+	mats.destroy();
+	cam = {};
+	ground = light = 0;
+}
+
+object moving_scene::init(i32 w, i32 h) {
+
+	cam.init({13.0f, 2.0f, 3.0f}, {}, w, h, 60.0f, 0.0f, {0.0f, 1.0f});
+	mats.clear();
+
+	ground = mats.add(material::lambertian(texture::constant({0.5f})));
+
+	vec<object> objs, spheres;
+
+	spheres.push(object::sphere(ground, {0.0f, -1000.0f, 0.0f}, 1000.0f));
+
+	// Bounces while the shutter is open; every third one stays put so the leaves mix both kinds
+	for (i32 a = -16; a < 16; a++) {
+		for (i32 b = -16; b < 16; b++) {
+
+			v3 center(a+0.9f*randomf(),0.2f,b+0.9f*randomf());
+
+			mat_id id = mats.add(material::lambertian(
+				texture::constant({randomf()*randomf(),
+								   randomf()*randomf(),
+								   randomf()*randomf()})));
+
+			if ((a + b) % 3 == 0) {
+				spheres.push(object::sphere(id, center, 0.2f));
+			} else {
+				v3 center1 = center + v3{0.0f, 0.5f * randomf(), 0.0f};
+				spheres.push(object::sphere_moving(id, center, center1, 0.2f, cam.time));
+			}
+		}
+	}
+
+	objs.push(object::bvh(spheres, cam.time, LANE_WIDTH, [](vec<object> list) -> object {
+
+		sphere_moving_lane_builder builder;
+
+		for(const object& o : list) {
+			builder.push(o);
+		}
+
+		return builder.finish();
+	}));
+
+	// The light isn't a sphere, so it stays out of the lanes
+	light = mats.add(material::diffuse(texture::constant({4.0f})));
+	objs.push(object::rect(light, plane::zx, {-10.0f, 10.0f}, {-10.0f, 10.0f}, 8.0f));
+
+	spheres.destroy();
+	return object::list(objs);
+}
+
 object basic_scene::init(i32 w, i32 h) {
 
 	cam.init({13.0f, 2.0f, 3.0f}, {}, w, h, 60.0f, 0.1f, {0.0f, 1.0f});
@@ -221,15 +506,26 @@ object cornell_box::init(i32 w, i32 h) {
 	green = mats.add(material::lambertian(texture::constant({0.12f, 0.45f, 0.15f})));
 	light = mats.add(material::diffuse(texture::constant({7.0f})));
 
-	vec<object> objs;
+	vec<object> objs, walls;
 
-	objs.push(object::rect(green, plane::yz, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
-	objs.push(object::rect(red, plane::yz, {0.0f, 555.0f}, {0.0f, 555.0f}, 0.0f));
-	objs.push(object::rect(light, plane::zx, {113.0f, 443.0f}, {127.0f, 432.0f}, 554.0f));
+	walls.push(object::rect(green, plane::yz, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
+	walls.push(object::rect(red, plane::yz, {0.0f, 555.0f}, {0.0f, 555.0f}, 0.0f));
+	walls.push(object::rect(light, plane::zx, {113.0f, 443.0f}, {127.0f, 432.0f}, 554.0f));
 	
-	objs.push(object::rect(white, plane::zx, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
-	objs.push(object::rect(white, plane::zx, {0.0f, 555.0f}, {0.0f, 555.0f}, 0.0f));
-	objs.push(object::rect(white, plane::xy, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
+	walls.push(object::rect(white, plane::zx, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
+	walls.push(object::rect(white, plane::zx, {0.0f, 555.0f}, {0.0f, 555.0f}, 0.0f));
+	walls.push(object::rect(white, plane::xy, {0.0f, 555.0f}, {0.0f, 555.0f}, 555.0f));
+
+	objs.push(object::bvh(walls, cam.time, LANE_WIDTH, [](vec<object> list) -> object {
+
+		rect_lane_builder builder;
+
+		for(const object& o : list) {
+			builder.push(o);
+		}
+
+		return builder.finish();
+	}));
 
 	dial = mats.add(material::dielectric(1.5f));
 
@@ -245,6 +541,7 @@ object cornell_box::init(i32 w, i32 h) {
 	objs.push(object::volume(black_vol, 0.01f, &box1));
 
 	object ret = object::bvh(objs, cam.time);
+	walls.destroy();
 	objs.destroy();
 	return ret;
 }
@@ -281,12 +578,62 @@ void planet_scene::destroy() {
 	flat = lamb = light = 0;
 }
 
+object smoke_scene::init(i32 w, i32 h) {
+
+	cam.init({0.0f, 3.0f, -12.0f}, {0.0f, 2.5f, 0.0f}, w, h, 40.0f, 0.0f, {0.0f, 0.0f});
+	mats.clear();
+
+	ground = mats.add(material::lambertian(texture::constant({0.5f})));
+	light = mats.add(material::diffuse(texture::constant({6.0f})));
+	smoke_mat = mats.add(material::isotropic(texture::constant({0.8f})));
+
+	// A plume that widens as it rises, broken up by turbulence; most of the box stays empty
+	const i32 res = 64;
+	v3 min = {-2.5f, 0.0f, -2.5f}, max = {2.5f, 6.0f, 2.5f};
+
+	f32* density = new f32[res * res * res];
+	for(i32 z = 0; z < res; z++) {
+		for(i32 y = 0; y < res; y++) {
+			for(i32 x = 0; x < res; x++) {
+
+				v3 p = (v3((f32)x, (f32)y, (f32)z) + 0.5f) / (f32)res;
+				f32 r = len(v3(p.x - 0.5f, 0.0f, p.z - 0.5f));
+				f32 edge = 0.08f + 0.35f * p.y;
+				f32 falloff = clamp(1.0f - r / edge, 0.0f, 1.0f) * clamp(p.y * 8.0f, 0.0f, 1.0f);
+
+				f32 turb = g_perlin.turb(p * 6.0f, 5);
+				density[(z * res + y) * res + x] = falloff * falloff * maxf(2.0f * turb - 0.2f, 0.0f);
+			}
+		}
+	}
+	smoke = object::volume_grid(smoke_mat, min, max, res, res, res, density, 12.0f);
+	delete[] density;
+
+	vec<object> objs;
+
+	objs.push(object::rect(ground, plane::zx, {-50.0f, 50.0f}, {-50.0f, 50.0f}, 0.0f));
+	objs.push(object::rect(light, plane::yz, {1.0f, 5.0f}, {-2.0f, 2.0f}, -6.0f));
+	objs.push(smoke);
+
+	object ret = object::bvh(objs, cam.time);
+	objs.destroy();
+	return ret;
+}
+
+void smoke_scene::destroy() {
+	smoke.destroy();
+	mats.destroy();
+	cam = {};
+	ground = light = smoke_mat = 0;
+	smoke = {};
+}
+
 object ps_showcase::init(i32 w, i32 h) {
 
 	cam.init({278.0f, 278.0f, -700.0f}, {220.0f, 240.0f, 300.0f}, w, h, 45.0f, 0.0f, {0.0f, 0.0f});
 	mats.clear();
 
-	vec<object> objs;
+	vec<object> objs, boxes;
 
 	white = mats.add(material::lambertian(texture::constant({0.73f, 0.73f, 0.73f})));
 	ground = mats.add(material::lambertian(texture::constant({0.48f, 0.83f, 0.53f})));
@@ -298,7 +645,7 @@ object ps_showcase::init(i32 w, i32 h) {
 			v3 xyz = {-1000.0f + i * d, 0.0f, -1000.0f + j * d};
 			v3 xyz1 = {xyz.x + d, 100.0f * (randomf() + 0.01f), xyz.z + d};
 
-			objs.push(object::box(ground, xyz, xyz1));
+			boxes.push(object::box(ground, xyz, xyz1));
 		}
 	}
 
@@ -329,10 +676,18 @@ object ps_showcase::init(i32 w, i32 h) {
 	objs.push(object::volume(vol1, 0.0005f, &bound1));
 
 	mars  = mats.add(material::lambertian(texture::image("mars.jpg")));
-	noise = mats.add(material::lambertian(texture::noise({}, 0.1f)));
+
+	v3 noise_pos = {220.0f, 280.0f, 300.0f};
+	f32 noise_rad = 80.0f;
+	if(bake_noise) {
+		v3 extent(noise_rad + 1.0f);
+		noise = mats.add(material::lambertian(texture::noise_baked({}, 0.1f, noise_pos - extent, noise_pos + extent)));
+	} else {
+		noise = mats.add(material::lambertian(texture::noise({}, 0.1f)));
+	}
 
 	objs.push(object::sphere(mars, {400.0f, 200.0f, 400.0f}, 100.0f));
-	objs.push(object::sphere(noise, {220.0f, 280.0f, 300.0f}, 80.0f));
+	objs.push(object::sphere(noise, noise_pos, noise_rad));
 
 	vec<object> spheres;
 
@@ -351,9 +706,22 @@ object ps_showcase::init(i32 w, i32 h) {
 		return builder.finish();
 	}, translate({-100.0f, 270.0f, 395.0f}) * rotate(15.0f, {0.0f, 1.0f, 0.0f})));
 
+	// Built last so the tree's random splits don't change where the spheres above end up
+	objs.push(object::bvh(boxes, cam.time, LANE_WIDTH, [](vec<object> list) -> object {
+
+		box_lane_builder builder;
+
+		for(const object& o : list) {
+			builder.push(o);
+		}
+
+		return builder.finish();
+	}));
+
 	object ret = object::bvh(objs, cam.time);
 
 	spheres.destroy();
+	boxes.destroy();
 	objs.destroy();
 	return ret;
 }
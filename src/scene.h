@@ -4,6 +4,7 @@
 #include "math.h"
 #include "object.h"
 #include "material.h"
+#include "environment.h"
 
 struct camera {
 
@@ -17,13 +18,21 @@ struct camera {
 	v2 time;
 
 	void init(v3 p, v3 l, i32 w, i32 h, f32 f, f32 ap, v2 t);
+	void resize(i32 w, i32 h);
 	void update();
 
+	// Viewport navigation; all of these call update()
+	void orbit(f32 yaw, f32 pitch);
+	void pan(f32 x, f32 y);
+	void dolly(f32 factor);
+	void move(v3 local);
+
 	ray get_ray(v2 uv, v2 jit) const;
 
 private:
 	v3 forward, right, up;
 	v3 lower_left, horz_step, vert_step;
+	f32 spread = 0.0f;
 };
 
 struct random_bvh_scene {
@@ -39,6 +48,19 @@ private:
 	i32 lamb0 = 0, lamb1 = 0, met0 = 0, dia0 = 0;
 };
 
+// Motion-blurred spheres, for exercising sphere_moving_lane leaves
+struct moving_scene {
+
+	object init(i32 w, i32 h);
+	void destroy();
+
+	camera cam;
+	materal_cache mats;
+
+private:
+	i32 ground = 0, light = 0;
+};
+
 struct basic_scene {
 	
 	object init(i32 w, i32 h);
@@ -74,6 +96,9 @@ struct ps_showcase {
 	camera cam;
 	materal_cache mats;
 
+	// Trades fine detail on the noise sphere for a much cheaper lookup
+	bool bake_noise = false;
+
 private:
 	i32 white = 0, ground = 0, light = 0, moving = 0, dial = 0, mtl = 0;
 	i32 vol0 = 0, vol1 = 0, mars = 0, noise = 0;
@@ -92,18 +117,96 @@ private:
 	i32 lamb = 0, light = 0, flat = 0;
 };
 
+struct smoke_scene {
+
+	object init(i32 w, i32 h);
+	void destroy();
+
+	camera cam;
+	materal_cache mats;
+
+private:
+	i32 ground = 0, light = 0, smoke_mat = 0;
+	// Owns the density grid; the tree only holds a copy
+	object smoke;
+};
+
+// NOTE(max): one primary hit in the first-hit cache. With a pinhole camera and a single shutter
+// time the same sub-pixel position always gives the same primary ray, so the renderer keeps a few
+// fixed positions per pixel and only traces each of them once.
+struct first_hit {
+	static const i32 Unknown = -1, Miss = -2, Random = -3;
+
+	i32 mat = Unknown;
+	f32 t = 0.0f;
+	v2 uv;
+	f32 uv_scale = 0.0f;
+	f32 normal[3] = {};
+};
+
+enum class scene_kind : u8 {
+	showcase,
+	random_bvh,
+	basic,
+	cornell,
+	planet,
+	smoke,
+	moving
+};
+
+static const char* const scene_kind_names[] = {"showcase", "random", "basic", "cornell", "planet", "smoke", "moving"};
+
 struct scene {
 
-	void init(i32 w, i32 h);
+	// bake_noise only changes the showcase
+	void init(i32 w, i32 h, bool bake_noise = false, scene_kind kind = scene_kind::showcase);
 	void destroy();
 	~scene();
 
+	// Only the camera depends on the resolution, so this doesn't touch the built geometry
+	void resize(i32 w, i32 h);
+
+	// Lights rays that escape the scene; an empty file removes it. Dropped by destroy().
+	bool set_environment(std::string file, f32 intensity = 1.0f);
+
+	// Hash of everything that changes what the scene renders (camera, options, environment), so
+	// a checkpoint can tell whether it was made of the same scene
+	u64 key() const;
+
 	v3 compute(const ray& into) const;
 	v3 sample(v2 uv) const;
 
+	// True if primary hits only depend on the sub-pixel position, i.e. they can be cached: a
+	// pinhole camera with a single shutter time that isn't sitting inside a medium
+	bool fixed_first_hits() const;
+	// Samples at a fixed sub-pixel position, filling in or reusing cache for the primary hit
+	v3 sample(v2 uv, v2 jit, first_hit& cache) const;
+
+	// NOTE(max): only safe to change while nothing is rendering the scene
+	camera& cam();
+
 private:
+	v3 shade(const ray& into, trace first) const;
+
 	object scene_obj;
+	environment env;
+	std::string env_file;
+	f32 env_intensity = 1.0f;
 	i32 max_depth = 16;
 
-	ps_showcase def;
+	// Grazing hits stretch the footprint without bound, so clamp how far it can be stretched
+	static constexpr f32 Min_Cone_Cos = 0.05f;
+
+	// NOTE(max): only the selected one is built; view and mats point into it
+	scene_kind kind = scene_kind::showcase;
+	camera* view = null;
+	materal_cache* mats = null;
+
+	ps_showcase showcase;
+	random_bvh_scene random_bvh;
+	basic_scene basic;
+	cornell_box cornell;
+	planet_scene planet;
+	smoke_scene smoke;
+	moving_scene moving;
 };
@@ -1,7 +1,19 @@
 
 #include "texture.h"
+#include "lib/vec.h"
+
+#include <mutex>
+#include <algorithm>
 #include <stb_image.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 constant constant::make(v3 c) {
 	constant ret;
 	ret.color = c;
@@ -19,13 +31,13 @@ checkerboard checkerboard::make(texture* o, texture* e) {
 	return ret;
 }
 
-v3 checkerboard::sample(v2 uv, v3 p) const {
+v3 checkerboard::sample(v2 uv, v3 p, f32 footprint) const {
 
 	f32 sin = sinf(10.0f * p.x) * sinf(10.0f * p.y) * sinf(10.0f * p.z);
 	
 	if(sin < 0.0f)
-		return odd->sample(uv,p);
-	return even->sample(uv,p);
+		return odd->sample(uv,p,footprint);
+	return even->sample(uv,p,footprint);
 }
 
 noise noise::make(v3 loc, f32 scale) {
@@ -35,41 +47,385 @@ noise noise::make(v3 loc, f32 scale) {
 	return ret;
 }
 
+void noise::destroy() {
+	delete[] grid;
+	grid = null;
+}
+
+f32 noise::turb(v3 p) const {
+	return g_perlin.turb(scale * (p + loc), Octaves);
+}
+
+void noise::bake(v3 min, v3 max) {
+
+	const i32 n = Bake_Resolution + 1;
+
+	delete[] grid;
+	grid = new f32[n * n * n];
+	grid_min = min;
+	grid_scale = v3((f32)Bake_Resolution) / (max - min);
+
+	v3 step = (max - min) / (f32)Bake_Resolution;
+	for(i32 z = 0; z < n; z++) {
+		for(i32 y = 0; y < n; y++) {
+			for(i32 x = 0; x < n; x++) {
+				grid[(z * n + y) * n + x] = turb(min + step * v3((f32)x, (f32)y, (f32)z));
+			}
+		}
+	}
+}
+
+f32 noise::baked(v3 p) const {
+
+	const i32 n = Bake_Resolution + 1;
+
+	v3 q = clamp((p - grid_min) * grid_scale, v3(0.0f), v3((f32)Bake_Resolution));
+	i32 x = min1((i32)q.x, Bake_Resolution - 1);
+	i32 y = min1((i32)q.y, Bake_Resolution - 1);
+	i32 z = min1((i32)q.z, Bake_Resolution - 1);
+	f32 fx = q.x - x, fy = q.y - y, fz = q.z - z;
+
+	const f32* c = grid + (z * n + y) * n + x;
+	f32 c00 = lerp(c[0], c[1], fx);
+	f32 c10 = lerp(c[n], c[n + 1], fx);
+	f32 c01 = lerp(c[n * n], c[n * n + 1], fx);
+	f32 c11 = lerp(c[n * n + n], c[n * n + n + 1], fx);
+	return lerp(lerp(c00, c10, fy), lerp(c01, c11, fy), fz);
+}
+
 v3 noise::sample(v2, v3 p) const {
+	f32 t = grid ? baked(p) : turb(p);
 	p += loc;
-	return 0.5f * (1.0f + sin(scale * p.x + 5.0f * g_perlin.turb(scale * p, 7)));
+	return 0.5f * (1.0f + sin(scale * p.x + 5.0f * t));
 }
 
-image image::make(std::string file) {
+// Each tile is Tile_Size x Tile_Size texels; edge tiles are padded by repeating the last texel
+static const i32 Tile_Size = 16;
+static const i32 Tile_Texels = Tile_Size * Tile_Size;
+static const i32 Max_Levels = 16;
 
-	image ret;
-	ret.data = stbi_load(file.c_str(), &ret.w, &ret.h, null, 4);
+// NOTE(max): per-thread, Cache_Sets x Cache_Ways tiles with LRU replacement inside each set.
+// Cached tiles are expanded to v3, which carries a padding float, so at 4kb per tile this is
+// 2mb per render thread, and it's all the texel memory there is.
+static const i32 Cache_Sets = 128;
+static const i32 Cache_Ways = 4;
+
+// The store keeps texels packed as three floats, so paging doesn't move v3's padding around
+struct packed_texel {
+	f32 r, g, b;
+};
+static_assert(sizeof(packed_texel) == 12, "sizeof(packed_texel) != 12");
+
+struct image_level {
+	i32 w = 0, h = 0, tiles_x = 0, tiles_y = 0;
+	// In texels from the start of the store
+	i64 offset = 0;
+};
+
+struct image_data {
+	std::string path;
+	u32 id = 0;
+	i32 refs = 0;
+
+	i32 levels = 0;
+	image_level level[Max_Levels];
+
+	// NOTE(max): the linear tiles of every level live in an anonymous temp file, and misses read
+	// them back one tile at a time, so the image itself never has to stay in memory. Only if the
+	// file can't be made do the tiles stay resident in texels instead. Reads are positional and
+	// never touch the file's position, so every render thread can page in tiles at once.
+	FILE* store = null;
+	packed_texel* texels = null;
+
+	bool read_tile(i32 li, u32 index, v3* out);
+};
 
-	if(!ret.data) {
+static std::mutex g_image_lock;
+static vec<image_data*> g_images;
+static u32 g_next_image_id = 1;
+
+static f32 g_to_linear[256];
+
+static bool read_at(FILE* f, i64 offset, void* out, u64 size) {
+#ifdef _WIN32
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno(f));
+	OVERLAPPED at = {};
+	at.Offset = (DWORD)offset;
+	at.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD read = 0;
+	return ReadFile(file, out, (DWORD)size, &read, &at) && read == size;
+#else
+	u8* dst = (u8*)out;
+	while(size) {
+		ssize_t n = pread(fileno(f), dst, size, (off_t)offset);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		dst += n;
+		offset += n;
+		size -= n;
+	}
+	return true;
+#endif
+}
+
+bool image_data::read_tile(i32 li, u32 index, v3* out) {
+
+	i64 first = level[li].offset + (i64)index * Tile_Texels;
+
+	packed_texel buf[Tile_Texels];
+	const packed_texel* src = texels ? texels + first : buf;
+	if(!texels && !read_at(store, first * (i64)sizeof(packed_texel), buf, sizeof(buf))) {
+		return false;
+	}
+
+	for(i32 i = 0; i < Tile_Texels; i++) {
+		out[i] = v3(src[i].r, src[i].g, src[i].b);
+	}
+	return true;
+}
+
+static image_data* load_image(std::string file) {
+
+	i32 w = 0, h = 0;
+	u8* pixels = stbi_load(file.c_str(), &w, &h, null, 4);
+
+	if(!pixels) {
 		std::cout << "Failed to load image from file " << file << "!" << std::endl;
+		return null;
+	}
+
+	if(g_to_linear[255] == 0.0f) {
+		for(i32 i = 0; i < 256; i++) {
+			g_to_linear[i] = powf(i / 255.0f, 2.2f);
+		}
+	}
+
+	image_data* ret = new image_data;
+	ret->path = file;
+
+	i64 total = 0;
+	for(i32 lw = w, lh = h; ret->levels < Max_Levels; lw = max1(lw / 2, 1), lh = max1(lh / 2, 1)) {
+		image_level& l = ret->level[ret->levels++];
+		l.w = lw;
+		l.h = lh;
+		l.tiles_x = (lw + Tile_Size - 1) / Tile_Size;
+		l.tiles_y = (lh + Tile_Size - 1) / Tile_Size;
+		l.offset = total;
+		total += (i64)l.tiles_x * l.tiles_y * Tile_Texels;
+		if(lw == 1 && lh == 1) break;
+	}
+
+	ret->store = tmpfile();
+	if(!ret->store) {
+		std::cout << "Failed to make a tile file for " << file << ", keeping it in memory." << std::endl;
+		ret->texels = new packed_texel[total];
 	}
 
+	// NOTE(max): one level is converted (or filtered from the one above) at a time and written out
+	// tile by tile, so loading needs about a level and a quarter of floats however large the chain is.
+	v3* linear = new v3[(i64)w * h];
+	v3* next = new v3[(i64)max1(w / 2, 1) * max1(h / 2, 1)];
+	for(i64 i = 0; i < (i64)w * h; i++) {
+		linear[i] = v3(g_to_linear[pixels[4*i]], g_to_linear[pixels[4*i + 1]], g_to_linear[pixels[4*i + 2]]);
+	}
+	stbi_image_free(pixels);
+
+	bool ok = true;
+	packed_texel tile[Tile_Texels];
+	for(i32 li = 0; ok && li < ret->levels; li++) {
+
+		const image_level& l = ret->level[li];
+
+		for(i32 ty = 0; ok && ty < l.tiles_y; ty++) {
+			for(i32 tx = 0; ok && tx < l.tiles_x; tx++) {
+
+				packed_texel* dst = ret->texels ? ret->texels + l.offset + ((i64)ty * l.tiles_x + tx) * Tile_Texels : tile;
+				for(i32 y = 0; y < Tile_Size; y++) {
+					i32 sy = min1(ty * Tile_Size + y, l.h - 1);
+					for(i32 x = 0; x < Tile_Size; x++) {
+						i32 sx = min1(tx * Tile_Size + x, l.w - 1);
+						v3 c = linear[sy * l.w + sx];
+						dst[y * Tile_Size + x] = {c.x, c.y, c.z};
+					}
+				}
+				if(ret->store) {
+					ok = fwrite(tile, sizeof(packed_texel), Tile_Texels, ret->store) == (size_t)Tile_Texels;
+				}
+			}
+		}
+
+		if(li + 1 == ret->levels) break;
+
+		// Box filter the next level down; odd edges just reuse their last texel
+		const image_level& n = ret->level[li + 1];
+		for(i32 y = 0; y < n.h; y++) {
+			i32 y0 = min1(2 * y, l.h - 1), y1 = min1(2 * y + 1, l.h - 1);
+			for(i32 x = 0; x < n.w; x++) {
+				i32 x0 = min1(2 * x, l.w - 1), x1 = min1(2 * x + 1, l.w - 1);
+				next[y * n.w + x] = 0.25f * (linear[y0 * l.w + x0] + linear[y0 * l.w + x1] +
+											 linear[y1 * l.w + x0] + linear[y1 * l.w + x1]);
+			}
+		}
+		std::swap(linear, next);
+	}
+
+	delete[] linear;
+	delete[] next;
+
+	if(ret->store && (!ok || fflush(ret->store) != 0)) {
+		std::cout << "Failed to write the tile file for " << file << "!" << std::endl;
+		fclose(ret->store);
+		delete ret;
+		return null;
+	}
+
+	return ret;
+}
+
+struct tile_cache {
+
+	~tile_cache() {
+		delete[] tiles;
+	}
+
+	// The pointer is only good until the next call
+	const v3* get(image_data* img, i32 level, i32 tx, i32 ty) {
+
+		const image_level& l = img->level[level];
+		u32 index = (u32)(ty * l.tiles_x + tx);
+		u64 key = (u64)img->id << 32 | (u64)level << 24 | index;
+
+		if(key == last_key) return last;
+
+		if(!tiles) {
+			tiles = new v3[Cache_Sets * Cache_Ways * Tile_Texels];
+		}
+
+		u32 set = (u32)((key * 0x9e3779b97f4a7c15ull) >> 56) % Cache_Sets;
+		i32 base = set * Cache_Ways, victim = base;
+
+		clock++;
+		for(i32 i = base; i < base + Cache_Ways; i++) {
+			if(keys[i] == key) {
+				used[i] = clock;
+				return remember(key, i);
+			}
+			if(used[i] < used[victim]) victim = i;
+		}
+
+		// A tile that can't be read comes out black rather than as whatever was in the slot
+		v3* dst = tiles + (i64)victim * Tile_Texels;
+		if(!img->read_tile(level, index, dst)) {
+			std::fill(dst, dst + Tile_Texels, v3());
+		}
+
+		keys[victim] = key;
+		used[victim] = clock;
+		return remember(key, victim);
+	}
+
+private:
+	const v3* remember(u64 key, i32 slot) {
+		last_key = key;
+		last = tiles + (i64)slot * Tile_Texels;
+		return last;
+	}
+
+	// Image ids start at 1 and are never reused, so zero is never a valid key and tiles of freed
+	// images just age out
+	u64 keys[Cache_Sets * Cache_Ways] = {};
+	u64 used[Cache_Sets * Cache_Ways] = {};
+	u64 clock = 0, last_key = 0;
+	v3* tiles = null;
+	const v3* last = null;
+};
+
+static thread_local tile_cache t_tiles;
+
+image image::make(std::string file) {
+
+	std::lock_guard<std::mutex> guard(g_image_lock);
+
+	image ret;
+	for(image_data* img : g_images) {
+		if(img->path == file) {
+			img->refs++;
+			ret.src = img;
+			return ret;
+		}
+	}
+
+	ret.src = load_image(file);
+	if(ret.src) {
+		ret.src->id = g_next_image_id++;
+		ret.src->refs = 1;
+		g_images.push(ret.src);
+	}
 	return ret;
 }
 
 void image::destroy() {
 
-	stbi_image_free(data);
-	data = null;
-	w = h = 0;
+	if(!src) return;
+
+	std::lock_guard<std::mutex> guard(g_image_lock);
+
+	if(--src->refs == 0) {
+		for(i32 i = 0; i < g_images.size; i++) {
+			if(g_images[i] == src) {
+				g_images[i] = g_images[g_images.size - 1];
+				g_images.size--;
+				break;
+			}
+		}
+		if(src->store) fclose(src->store);
+		delete[] src->texels;
+		delete src;
+	}
+	src = null;
+}
+
+v3 image::bilinear(i32 level, v2 uv) const {
+
+	const image_level& l = src->level[level];
+
+	// Texel centers are at half coordinates; edges clamp
+	f32 x = clamp(uv.x, 0.0f, 1.0f) * l.w - 0.5f;
+	f32 y = clamp(1.0f - uv.y, 0.0f, 1.0f) * l.h - 0.5f;
+	f32 fx = floorf(x), fy = floorf(y);
+	f32 ax = x - fx, ay = y - fy;
+
+	i32 x0 = max1((i32)fx, 0), x1 = min1((i32)fx + 1, l.w - 1);
+	i32 y0 = max1((i32)fy, 0), y1 = min1((i32)fy + 1, l.h - 1);
+
+	auto texel = [&](i32 tx, i32 ty) {
+		const v3* t = t_tiles.get(src, level, tx / Tile_Size, ty / Tile_Size);
+		return t[(ty % Tile_Size) * Tile_Size + tx % Tile_Size];
+	};
+
+	v3 top = lerp(texel(x0, y0), texel(x1, y0), ax);
+	v3 bot = lerp(texel(x0, y1), texel(x1, y1), ax);
+	return lerp(top, bot, ay);
 }
 
-v3 image::sample(v2 uv, v3) const {
+v3 image::sample(v2 uv, v3, f32 footprint) const {
 
-	// TODO(max): texture filtering / mip-mapping?
 	// TODO(max): transparency?
 
-	i32 tx = (i32)clamp(uv.x * w, 0.0f, (f32)(w - 1));
-	i32 ty = (i32)clamp((1.0f - uv.y) * h, 0.0f, (f32)(h - 1));
+	if(!src) return {};
 
-	f32 r = data[4*ty*w + 4*tx] / 255.0f;
-	f32 g = data[4*ty*w + 4*tx + 1] / 255.0f;
-	f32 b = data[4*ty*w + 4*tx + 2] / 255.0f;
+	const image_level& base = src->level[0];
+	i32 levels = src->levels;
 
-	return pow(v3(r,g,b), 2.2f);
+	f32 texels = footprint * sqrtf((f32)base.w * base.h);
+	if(texels <= 1.0f) {
+		return bilinear(0, uv);
+	}
+
+	f32 lod = minf(log2f(texels), (f32)(levels - 1));
+	i32 l0 = (i32)lod;
+	if(l0 >= levels - 1) {
+		return bilinear(levels - 1, uv);
+	}
+	return lerp(bilinear(l0, uv), bilinear(l0 + 1, uv), lod - l0);
 }
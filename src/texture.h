@@ -29,7 +29,7 @@ struct checkerboard {
 	static checkerboard make(texture* o, texture* e);
 	void destroy() {odd = even = null;}
 
-	v3 sample(v2 uv, v3 p) const;
+	v3 sample(v2 uv, v3 p, f32 footprint) const;
 
 private:
 	texture *odd = null, *even = null;
@@ -38,25 +38,48 @@ private:
 struct noise {
 
 	static noise make(v3 loc, f32 scale);
-	void destroy() {}
+	void destroy();
+
+	// NOTE(max): evaluates the turbulence at every point of a Bake_Resolution^3 grid over
+	// [min,max] and trilinearly interpolates it afterwards. Much faster to sample, but detail
+	// finer than a grid cell is smoothed out, and points outside the box clamp to its edge.
+	void bake(v3 min, v3 max);
 
 	v3 sample(v2 uv, v3 p) const;
 
 private:
+	f32 turb(v3 p) const;
+	f32 baked(v3 p) const;
+
+	static const i32 Bake_Resolution = 128;
+	static const i32 Octaves = 7;
+
 	f32 scale = 1.0f;
 	v3 loc;
+
+	f32* grid = null;
+	v3 grid_min, grid_scale;
 };
 
+struct image_data;
+
+// NOTE(max): images are loaded once per path and shared (refcounted) between every texture that
+// uses them. The linear mip chain is cut into square tiles and written to a temp file, and lookups
+// page tiles in on demand through a small fixed-size per-thread cache. Texel memory is then bounded
+// by the cache no matter how many or how large the images are, and the four texels of a bilinear
+// lookup usually come from one tile.
 struct image {
 
 	static image make(std::string file);
 	void destroy();
 
-	v3 sample(v2 uv, v3 p) const;
+	// footprint is the width of the ray cone in uv units, and picks the mip level
+	v3 sample(v2 uv, v3 p, f32 footprint) const;
 
 private:
-	u8* data = null;
-	i32 w = 0, h = 0;
+	v3 bilinear(i32 level, v2 uv) const;
+
+	image_data* src = null;
 };
 
 struct texture {
@@ -85,18 +108,23 @@ struct texture {
 		ret.n = noise::make(loc, scale);
 		return ret;
 	}
+	static texture noise_baked(v3 loc, f32 scale, v3 min, v3 max) {
+		texture ret = noise(loc, scale);
+		ret.n.bake(min, max);
+		return ret;
+	}
 	static texture image(std::string file) {
 		texture ret;
 		ret.type = tex::image;
 		ret.i = image::make(file);
 		return ret;
 	}
-	v3 sample(v2 uv, v3 p) const {
+	v3 sample(v2 uv, v3 p, f32 footprint = 0.0f) const {
 		switch(type) {
 		case tex::constant: return c.sample(uv,p);
-		case tex::checkerboard: return cb.sample(uv,p);
+		case tex::checkerboard: return cb.sample(uv,p,footprint);
 		case tex::noise: return n.sample(uv,p);
-		case tex::image: return i.sample(uv,p);
+		case tex::image: return i.sample(uv,p,footprint);
 		default: assert(false);
 		}
 		return {};